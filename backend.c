@@ -0,0 +1,146 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * backend.c - The umalloc and C library backends, and backends loaded from a
+ * shared object at run time.
+ **************************************************************************/
+
+#define _GNU_SOURCE /* for RTLD_DEEPBIND */
+#include "backend.h"
+#include "umalloc.h"
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <malloc.h>
+
+extern size_t held_bytes;
+
+/*
+ * held_footprint - Returns the bytes a tracked csbrk holds right now.
+ */
+static size_t held_footprint(const backend_t *backend)
+{
+    return *backend->held_bytes;
+}
+
+/*
+ * libc_footprint - Returns the bytes the C library malloc holds in its arenas
+ * and in mappings of their own.
+ */
+static size_t libc_footprint(const backend_t *backend)
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+}
+
+/* The allocator of this build. Its footprint is only known with a tracked csbrk. */
+static const backend_t umalloc_backend = {
+    .name = "umalloc",
+    .init = uinit,
+    .malloc = umalloc,
+    .free = ufree,
+    .realloc = urealloc,
+    .aligned_alloc = ualigned_alloc,
+    .footprint = held_footprint,
+    .held_bytes = &held_bytes,
+};
+
+/* The C library malloc, which has no heap to reset between runs */
+static const backend_t libc_backend = {
+    .name = "libc",
+    .malloc = malloc,
+    .free = free,
+    .realloc = realloc,
+    .aligned_alloc = aligned_alloc,
+    .footprint = libc_footprint,
+};
+
+/*
+ * load_shared - Loads a backend from a shared object, either a build of umalloc
+ * (uinit, umalloc, ufree, urealloc and ualigned_alloc) or a malloc replacement
+ * (malloc, free, realloc and aligned_alloc). The object binds its own symbols
+ * ahead of the ones already loaded, so that a build of umalloc runs on its own
+ * heap and csbrk rather than those of the driver. Its footprint is known if it
+ * was built with a tracked csbrk.
+ */
+static const backend_t *load_shared(const char *path)
+{
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL | RTLD_DEEPBIND);
+    if (handle == NULL)
+    {
+        fprintf(stderr, "Could not load backend %s: %s\n", path, dlerror());
+        return NULL;
+    }
+    backend_t *backend = calloc(1, sizeof(backend_t));
+    if (backend == NULL)
+    {
+        dlclose(handle);
+        return NULL;
+    }
+    backend->name = path;
+    backend->handle = handle;
+    backend->init = (int (*)(void))dlsym(handle, "uinit");
+    if (backend->init != NULL)
+    {
+        backend->malloc = (void *(*)(size_t))dlsym(handle, "umalloc");
+        backend->free = (void (*)(void *))dlsym(handle, "ufree");
+        backend->realloc = (void *(*)(void *, size_t))dlsym(handle, "urealloc");
+        backend->aligned_alloc = (void *(*)(size_t, size_t))dlsym(handle, "ualigned_alloc");
+    }
+    else
+    {
+        backend->malloc = (void *(*)(size_t))dlsym(handle, "malloc");
+        backend->free = (void (*)(void *))dlsym(handle, "free");
+        backend->realloc = (void *(*)(void *, size_t))dlsym(handle, "realloc");
+        backend->aligned_alloc = (void *(*)(size_t, size_t))dlsym(handle, "aligned_alloc");
+    }
+    backend->held_bytes = dlsym(handle, "held_bytes");
+    if (backend->held_bytes != NULL)
+    {
+        backend->footprint = held_footprint;
+    }
+    if (backend->malloc == NULL || backend->free == NULL || backend->realloc == NULL)
+    {
+        fprintf(stderr, "Backend %s defines neither umalloc, ufree and urealloc nor malloc, free and realloc\n", path);
+        backend_unload(backend);
+        return NULL;
+    }
+    return backend;
+}
+
+/*
+ * backend_load - Returns the backend by the given name: umalloc, libc, or the
+ * path of a shared object, told apart by a slash. Prints the reason and
+ * returns NULL if there is no such backend.
+ */
+const backend_t *backend_load(const char *name)
+{
+    if (strcmp(name, umalloc_backend.name) == 0)
+    {
+        return &umalloc_backend;
+    }
+    if (strcmp(name, libc_backend.name) == 0)
+    {
+        return &libc_backend;
+    }
+    if (strchr(name, '/') != NULL)
+    {
+        return load_shared(name);
+    }
+    fprintf(stderr, "Unknown backend %s: expected umalloc, libc or the path of a shared object\n", name);
+    return NULL;
+}
+
+/*
+ * backend_unload - Unloads a backend loaded from a shared object. The built in
+ * backends are left alone.
+ */
+void backend_unload(const backend_t *backend)
+{
+    if (backend->handle == NULL)
+    {
+        return;
+    }
+    dlclose(backend->handle);
+    free((backend_t *)backend);
+}
@@ -0,0 +1,36 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * backend.h - Allocator backends the trace drivers can replay a trace with,
+ * so that umalloc can be compared against the C library malloc, or against
+ * another build of itself, on the same trace in the same process.
+ **************************************************************************/
+
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stdlib.h>
+
+#define BACKEND_MAX 8 /* most backends a driver compares at once */
+
+/*
+ * backend_t - The entry points of an allocator. init, aligned_alloc and
+ * footprint may be NULL when the allocator has no use for them.
+ */
+typedef struct backend
+{
+    const char *name;
+    int (*init)(void);                                     /* readies an empty heap, -1 on failure */
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    void *(*aligned_alloc)(size_t alignment, size_t size);
+    size_t (*footprint)(const struct backend *backend);   /* bytes held from the kernel right now */
+    const size_t *held_bytes;                              /* the counter of a tracked csbrk, if any */
+    void *handle;                                          /* the shared object, NULL if built in */
+} backend_t;
+
+const backend_t *backend_load(const char *name);
+void backend_unload(const backend_t *backend);
+
+#endif
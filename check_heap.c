@@ -2,96 +2,527 @@
 #include "umalloc.h"
 
 //Place any variables needed here from umalloc.c as an extern.
-extern memory_block_t *free_head;
-extern const int MAGIC_NUMBER;
+extern const int HEADER_SIZE;
 
 const int INVALID_BLOCK = 1;
 const int ALLOCATED = 2;
 const int INVALID_FOOTER = 3;
 const int FOOTER_MISMATCH = 4;
 const int CONTIGUOUS = 5;
-const int LIST_ORDER = 6;
+const int WRONG_BIN = 6;
+const int BROKEN_LINKS = 7;
+const int BITMAP_MISMATCH = 8;
+const int PAGEMAP_MISMATCH = 9;
+const int PREV_FREE_MISMATCH = 10;
+const int LOST_BLOCK = 11;
+const int SLAB_COUNT_MISMATCH = 12;
+const int SLAB_WRONG_LIST = 13;
+const int HEAP_MISMATCH = 14;
+const int TREE_INVALID = 15;
+const int QUICK_MISMATCH = 16;
+const int WILDERNESS_MISMATCH = 17;
+
+// Stand-ins for the bin indices of free blocks kept outside of the bins
+#define IN_TREE -1
+#define IN_WILDERNESS -2
 
 /*
- * check_heap -  used to check that the heap is still in a consistent state.
- * Required to be completed for checkpoint 1.
- * Should return 0 if the heap is still consistent, otherwise return a non-zero
- * return code. Asserts are also a useful tool here.
+ * check_free_block - checks a single block found in the free bins, or in the tree
+ * or as the wilderness if fl is IN_TREE or IN_WILDERNESS. Returns 0 if the block
+ * is consistent, otherwise one of the error codes above.
  */
-int check_heap()
+static int check_free_block(memory_block_t *free_block, int fl, int sl)
+{
+    // Check 1 - Is the pointer pointing to a valid block?
+    if (!contained_in_block(free_block) || ((size_t)get_payload(free_block)) % ALIGNMENT != 0 ||
+        get_size(free_block) < MIN_BLOCK_SIZE)
+    {
+        return INVALID_BLOCK;
+    }
+
+    // Check that the whole block lies in a single region
+    memory_block_t *above = get_above_header(free_block);
+    if (pagemap_lookup(free_block) != pagemap_lookup(above))
+    {
+        return INVALID_BLOCK;
+    }
+
+    // Check 2 - Is the block free?
+    if (is_allocated(free_block))
+    {
+        return ALLOCATED;
+    }
+
+    // Check 3 - Is the block stored in the bin for its size, or in the tree if it
+    // is large?
+    if (fl == IN_WILDERNESS)
+    {
+        // The wilderness can have any size, but is the top block of its region
+        sbrk_block *region = pagemap_lookup(free_block)->heap->wilderness_region;
+        if ((uint64_t)above != region->sbrk_end - HEADER_SIZE)
+        {
+            return WILDERNESS_MISMATCH;
+        }
+    }
+    else if (fl == IN_TREE)
+    {
+        if (get_size(free_block) < TREE_MIN_SIZE)
+        {
+            return WRONG_BIN;
+        }
+    }
+    else
+    {
+        int block_fl, block_sl;
+        mapping_insert(get_size(free_block), &block_fl, &block_sl);
+        if (block_fl != fl || block_sl != sl || get_size(free_block) >= TREE_MIN_SIZE)
+        {
+            return WRONG_BIN;
+        }
+
+        // Check 4 - Are the list links consistent?
+        if (free_block->next == NULL || free_block->prev == NULL ||
+            free_block->next->prev != free_block || free_block->prev->next != free_block)
+        {
+            return BROKEN_LINKS;
+        }
+    }
+
+    // Check 5 - Does the footer match the header, and does the block above know
+    // that it is there?
+    if (get_size_footer(get_footer(free_block)) != get_size(free_block))
+    {
+        return FOOTER_MISMATCH;
+    }
+    if (!is_prev_free(above))
+    {
+        return INVALID_FOOTER;
+    }
+
+    // Check 6 - Are there any free blocks adjacent to this one?
+    if (is_prev_free(free_block) || !is_allocated(above))
+    {
+        // Found contiguous free block, not coalesced
+        return CONTIGUOUS;
+    }
+
+    return 0;
+}
+
+/*
+ * check_regions - walks every block of every region from its first block up to
+ * the epilogue, checking that the blocks tile the region and that the prev free
+ * bits agree with the blocks below them. Stores the number of free blocks seen,
+ * and of allocated blocks waiting in the quick lists.
+ */
+static int check_regions(uheap_t *heap, size_t *free_count, size_t *quick_count)
 {
-    memory_block_t *free_block = free_head;
+    *free_count = 0;
+    *quick_count = 0;
+    for (sbrk_block *region = heap->block_head; region != NULL; region = region->next)
+    {
+        if (region->kind != REGION_HEAP || region->heap != heap)
+        {
+            return HEAP_MISMATCH;
+        }
+
+        // Every region must be found by the page map from its first and last byte
+        if (pagemap_lookup(region) != region ||
+            pagemap_lookup((void *)region->sbrk_start) != region ||
+            pagemap_lookup((void *)(region->sbrk_end - 1)) != region)
+        {
+            return PAGEMAP_MISMATCH;
+        }
+
+        memory_block_t *epilogue = (memory_block_t *)(region->sbrk_end - HEADER_SIZE);
+        memory_block_t *block = (memory_block_t *)region->sbrk_start;
+        bool below_free = false;
+        while (block != epilogue)
+        {
+            if (get_size(block) < MIN_BLOCK_SIZE || (void *)get_above_header(block) > (void *)epilogue)
+            {
+                return INVALID_BLOCK;
+            }
+            if (is_prev_free(block) != below_free)
+            {
+                return PREV_FREE_MISMATCH;
+            }
+            below_free = !is_allocated(block);
+            *free_count += below_free;
+            if (block->block_size_alloc & QUICK_BIT)
+            {
+                // Only allocated blocks can be cached
+                if (below_free)
+                {
+                    return QUICK_MISMATCH;
+                }
+                (*quick_count)++;
+            }
+            block = get_above_header(block);
+        }
+
+        if (!is_allocated(epilogue) || is_prev_free(epilogue) != below_free)
+        {
+            return PREV_FREE_MISMATCH;
+        }
+    }
+    return 0;
+}
 
-    // Check if free list is empty
-    if (free_block == NULL)
+/*
+ * check_slab_list - checks the runs of one circular run list, which must all have
+ * a free object, be owned by the given cache and, unless class is negative, belong
+ * to the given size class. Adds the number of runs seen to count.
+ */
+static int check_slab_list(slab_run_t *head, int class, thread_cache_t *owner, size_t *count)
+{
+    if (head == NULL)
     {
         return 0;
     }
-    // Check each free block in the free list
+    slab_run_t *run = head;
     do
     {
-
-        // Check 1 - Is the pointer pointing to a valid block?
-        if (!contained_in_block(free_block) || free_block->magic_number != MAGIC_NUMBER)
+        if (run->free_count == 0 || run->owner != owner || (class >= 0 && slab_class(run->object_size) != class) ||
+            run->next->prev != run || run->prev->next != run)
         {
-            return INVALID_BLOCK;
+            return SLAB_WRONG_LIST;
         }
+        (*count)++;
+        run = run->next;
+    } while (run != head);
+    return 0;
+}
 
-        // Check 2 - Is the block free?
-        if (is_allocated(free_block))
+/*
+ * check_slabs - checks every slab run: it must be found by the page map, its free
+ * count must match its bitmap, and exactly the runs with free objects must be on
+ * the partial list of a thread cache or on the empty list of the heap.
+ */
+static int check_slabs(uheap_t *heap)
+{
+    size_t available = 0;
+    for (sbrk_block *region = heap->slab_head; region != NULL; region = region->next)
+    {
+        slab_run_t *run = (slab_run_t *)region;
+        if (region->heap != heap)
+        {
+            return HEAP_MISMATCH;
+        }
+        if (region->kind != REGION_SLAB || pagemap_lookup(run) != region ||
+            pagemap_lookup((void *)region->sbrk_start) != region ||
+            pagemap_lookup((void *)(region->sbrk_end - 1)) != region)
         {
-            return ALLOCATED;
+            return PAGEMAP_MISMATCH;
         }
 
-        // Check 3 - Is the block larger than the previous?
-        if (free_block != free_head && get_size(free_block) < get_size(free_block->prev))
+        if (run->object_size == 0 || run->object_size % ALIGNMENT != 0 || run->capacity == 0 ||
+            run->capacity > SLAB_MAP_WORDS * 64 ||
+            run->capacity > (region->sbrk_end - region->sbrk_start) / run->object_size)
         {
-            return LIST_ORDER;
+            return INVALID_BLOCK;
         }
 
-        // Check 4 - Does the information in the header and footer match?
-        footer_t *footer = get_footer(free_block);
+        unsigned int free_count = 0;
+        for (int word = 0; word < SLAB_MAP_WORDS; word++)
+        {
+            free_count += __builtin_popcountl(run->free_map[word]);
+        }
+        // Bits past the last object must stay clear
+        unsigned int last = run->capacity;
+        if (last < SLAB_MAP_WORDS * 64 && (run->free_map[last / 64] >> (last % 64)) != 0)
+        {
+            return SLAB_COUNT_MISMATCH;
+        }
+        if (free_count != run->free_count)
+        {
+            return SLAB_COUNT_MISMATCH;
+        }
+        available += free_count > 0;
+    }
 
-        // Check that footer is a valid footer
-        if (footer->magic_number != MAGIC_NUMBER)
+    size_t listed = 0;
+    for (thread_cache_t *cache = heap->thread_caches; cache != NULL; cache = cache->next)
+    {
+        if (pagemap_lookup(cache) == NULL || pagemap_lookup(cache)->heap != heap)
+        {
+            return HEAP_MISMATCH;
+        }
+        for (int class = 0; class < SLAB_CLASS_COUNT; class++)
         {
-            return INVALID_FOOTER;
+            int ret = check_slab_list(cache->partial[class], class, cache, &listed);
+            if (ret != 0)
+            {
+                return ret;
+            }
         }
+    }
+    int ret = check_slab_list(heap->slab_empty, -1, NULL, &listed);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    return listed == available ? 0 : SLAB_WRONG_LIST;
+}
 
-        // Compare the data between the header and the footer
-        if (free_block->block_size_alloc != footer->block_size_alloc)
+/*
+ * check_mmaps - checks every mapping of a large request of the heap: it must be
+ * found by the page map, belong to the heap and be linked both ways.
+ */
+static int check_mmaps(uheap_t *heap)
+{
+    sbrk_block *prev = NULL;
+    for (sbrk_block *region = heap->mmap_head; region != NULL; region = region->next)
+    {
+        mmap_region_t *map = (mmap_region_t *)region;
+        if (region->kind != REGION_MMAP || region->heap != heap)
         {
-            return FOOTER_MISMATCH;
+            return HEAP_MISMATCH;
         }
+        if (pagemap_lookup(map) != region || pagemap_lookup((void *)region->sbrk_start) != region ||
+            pagemap_lookup((void *)(region->sbrk_end - 1)) != region)
+        {
+            return PAGEMAP_MISMATCH;
+        }
+        if (region->sbrk_start % ALIGNMENT != 0 || (uint64_t)map % PAGESIZE != 0 ||
+            region->sbrk_end % PAGESIZE != 0)
+        {
+            return INVALID_BLOCK;
+        }
+        if (map->prev != prev)
+        {
+            return BROKEN_LINKS;
+        }
+        prev = region;
+    }
+    return 0;
+}
 
-        // Check 5 - Are there any free blocks adjacent to this one?
-        // Check below
-        footer = ((footer_t *)free_block) - 1;
-        if (contained_in_block((void *)footer) && footer->magic_number == MAGIC_NUMBER)
+/*
+ * check_quick_lists - checks that every block in the quick lists is a block of the
+ * heap, marked allocated and cached, and of the size of its list. Cached blocks
+ * are legal free blocks that have not been coalesced yet. Stores the number of
+ * blocks seen.
+ */
+static int check_quick_lists(uheap_t *heap, size_t *count)
+{
+    size_t quick_size = 0;
+    *count = 0;
+    for (int index = 0; index < QUICK_LIST_COUNT; index++)
+    {
+        for (memory_block_t *block = heap->quick_lists[index]; block != NULL; block = block->next)
         {
-            // Valid footer
-            if (!is_allocated_footer(footer))
+            sbrk_block *region = pagemap_lookup(block);
+            if (region == NULL || region->kind != REGION_HEAP || region->heap != heap ||
+                (uint64_t)block < region->sbrk_start)
+            {
+                return INVALID_BLOCK;
+            }
+            if (!is_allocated(block) || !(block->block_size_alloc & QUICK_BIT) ||
+                get_size(block) / ALIGNMENT != (size_t)index)
             {
-                // Found contiguous free block, not coalesced
-                return CONTIGUOUS;
+                return QUICK_MISMATCH;
             }
+            quick_size += get_size(block);
+            (*count)++;
+        }
+    }
+    return quick_size == heap->quick_size ? 0 : QUICK_MISMATCH;
+}
+
+/*
+ * check_tree - checks the subtree under node: its parent links, its order by size
+ * and address, that no red node has a red child and that every path down holds
+ * the same number of black nodes. Each node is checked as a free block and
+ * counted. Stores the number of black nodes on a path down, leaf included.
+ */
+static int check_tree(uheap_t *heap, tree_block_t *node, size_t *count, int *black_height)
+{
+    tree_block_t *nil = &heap->tree_nil;
+    if (node == nil)
+    {
+        *black_height = 1;
+        return nil->red ? TREE_INVALID : 0;
+    }
+    if (node->left == NULL || node->right == NULL ||
+        (node->left != nil && node->left->parent != node) ||
+        (node->right != nil && node->right->parent != node))
+    {
+        return BROKEN_LINKS;
+    }
+    size_t size = get_size((memory_block_t *)node);
+    size_t left_size = get_size((memory_block_t *)node->left);
+    size_t right_size = get_size((memory_block_t *)node->right);
+    if ((node->left != nil && (left_size > size || (left_size == size && node->left > node))) ||
+        (node->right != nil && (right_size < size || (right_size == size && node->right < node))))
+    {
+        return TREE_INVALID;
+    }
+    if (node->red && (node->left->red || node->right->red))
+    {
+        return TREE_INVALID;
+    }
+
+    int ret = check_free_block((memory_block_t *)node, IN_TREE, 0);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    (*count)++;
+
+    int left_height, right_height;
+    ret = check_tree(heap, node->left, count, &left_height);
+    if (ret == 0)
+    {
+        ret = check_tree(heap, node->right, count, &right_height);
+    }
+    if (ret != 0)
+    {
+        return ret;
+    }
+    if (left_height != right_height)
+    {
+        return TREE_INVALID;
+    }
+    *black_height = left_height + !node->red;
+    return 0;
+}
+
+/*
+ * check_uheap - checks that the given heap is in a consistent state. Returns 0 if
+ * it is, otherwise one of the error codes above.
+ */
+int check_uheap(uheap_t *heap)
+{
+    size_t region_free_count, region_quick_count, quick_count;
+    int ret = check_regions(heap, &region_free_count, &region_quick_count);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    // Every cached block in the heap must be in exactly one quick list
+    ret = check_quick_lists(heap, &quick_count);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    if (quick_count != region_quick_count)
+    {
+        return QUICK_MISMATCH;
+    }
+
+    ret = check_slabs(heap);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    ret = check_mmaps(heap);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    size_t bin_free_count = 0;
+    for (int fl = 0; fl < FL_INDEX_COUNT; fl++)
+    {
+        // The first level bit must be set exactly when some second level bit is
+        if (((heap->fl_bitmap >> fl) & 0x1) != (heap->sl_bitmap[fl] != 0))
+        {
+            return BITMAP_MISMATCH;
         }
 
-        // Check above
-        memory_block_t *header = get_above_header(free_block);
-        if (contained_in_block((void *)header) && header->magic_number == MAGIC_NUMBER)
+        for (int sl = 0; sl < SL_INDEX_COUNT; sl++)
         {
-            // Valid header
-            if (!is_allocated(header))
+            memory_block_t *head = heap->free_bins[fl][sl];
+
+            // The second level bit must be set exactly when the bin is non-empty
+            if (((heap->sl_bitmap[fl] >> sl) & 0x1) != (head != NULL))
+            {
+                return BITMAP_MISMATCH;
+            }
+
+            if (head == NULL)
             {
-                // Found contiguous free block, not coalesced
-                return CONTIGUOUS;
+                continue;
             }
+
+            // Check each free block in the bin
+            memory_block_t *free_block = head;
+            do
+            {
+                ret = check_free_block(free_block, fl, sl);
+                if (ret != 0)
+                {
+                    return ret;
+                }
+                bin_free_count++;
+                free_block = free_block->next;
+            } while (free_block != head && bin_free_count <= region_free_count);
+        }
+    }
+
+    // The root of the tree is black and has no parent
+    tree_block_t *root = heap->free_tree;
+    if (root != &heap->tree_nil && (root->red || root->parent != &heap->tree_nil))
+    {
+        return TREE_INVALID;
+    }
+    int black_height;
+    ret = check_tree(heap, root, &bin_free_count, &black_height);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    // The wilderness is the top block of the wilderness region whenever that block
+    // is free, and is not in any bin
+    sbrk_block *wilderness_region = heap->wilderness_region;
+    if (wilderness_region != NULL)
+    {
+        if (pagemap_lookup(wilderness_region) != wilderness_region || wilderness_region->heap != heap)
+        {
+            return WILDERNESS_MISMATCH;
+        }
+        memory_block_t *epilogue = (memory_block_t *)(wilderness_region->sbrk_end - HEADER_SIZE);
+        if (is_prev_free(epilogue) != (heap->wilderness != NULL))
+        {
+            return WILDERNESS_MISMATCH;
+        }
+    }
+    if (heap->wilderness != NULL)
+    {
+        if (wilderness_region == NULL || pagemap_lookup(heap->wilderness) != wilderness_region)
+        {
+            return WILDERNESS_MISMATCH;
+        }
+        ret = check_free_block(heap->wilderness, IN_WILDERNESS, 0);
+        if (ret != 0)
+        {
+            return ret;
         }
+        bin_free_count++;
+    }
 
-        free_block = free_block->next;
-    } while (free_block != free_head);
+    // Every free block in the heap must be reachable from a bin, the tree or the
+    // wilderness
+    if (bin_free_count != region_free_count)
+    {
+        return LOST_BLOCK;
+    }
 
     // Consistent Heap
     return 0;
+}
+
+/*
+ * check_heap -  used to check that the heap is still in a consistent state.
+ * Required to be completed for checkpoint 1.
+ * Should return 0 if the heap is still consistent, otherwise return a non-zero
+ * return code. Asserts are also a useful tool here.
+ */
+int check_heap()
+{
+    return check_uheap(uheap_default());
 }
\ No newline at end of file
@@ -0,0 +1,46 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * convert_trace.c - Converts a text trace to a binary one, which runner and
+ * performance map without parsing, and a binary trace back to text
+ **************************************************************************/
+
+#include "support.h"
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: convert_trace [-h] infile outfile\n");
+    fprintf(stderr, "Writes a text infile out as a binary trace, and a binary one as text.\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+}
+
+int main(int argc, char **argv) {
+    int c;
+
+    while ((c = getopt(argc, argv, "h")) != EOF) {
+        switch (c) {
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (argc - optind != 2) {
+        usage();
+        appl_error("Missing file parameters.");
+    }
+
+    trace_t *trace = read_trace(argv[optind], 0);
+    bool binary = trace->map == NULL;
+    write_trace(trace, argv[optind + 1], binary);
+    printf("Wrote %d ops of %s to %s as %s\n", trace->num_ops, argv[optind], argv[optind + 1],
+           binary ? "a binary trace" : "text");
+    free_trace(trace);
+    return 0;
+}
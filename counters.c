@@ -0,0 +1,135 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * counters.c - Hardware performance counters through perf_event_open.
+ **************************************************************************/
+
+#include "counters.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/* The perf event behind each counter */
+static const struct
+{
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} events[COUNTER_COUNT] = {
+    [COUNTER_CYCLES] = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [COUNTER_INSTRUCTIONS] = {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [COUNTER_L1D_MISSES] = {"L1D misses", PERF_TYPE_HW_CACHE,
+                            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    [COUNTER_LLC_MISSES] = {"LLC misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [COUNTER_BRANCH_MISSES] = {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    [COUNTER_DTLB_MISSES] = {"dTLB misses", PERF_TYPE_HW_CACHE,
+                             PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+/*
+ * counters_open - Opens every counter it can for the calling thread, disabled and
+ * counting user space only. Returns the number of counters opened, 0 if the
+ * counters are unavailable, in which case error holds the reason.
+ */
+int counters_open(counters_t *counters)
+{
+    *counters = (counters_t){.opened = 0};
+    for (int counter = 0; counter < COUNTER_COUNT; counter++)
+    {
+        struct perf_event_attr attr = {0};
+        attr.size = sizeof(attr);
+        attr.type = events[counter].type;
+        attr.config = events[counter].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counters->fds[counter] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters->fds[counter] == -1)
+        {
+            if (counters->error == 0)
+            {
+                counters->error = errno;
+            }
+            continue;
+        }
+        counters->opened++;
+    }
+    return counters->opened;
+}
+
+/*
+ * counters_start - Starts counting.
+ */
+void counters_start(counters_t *counters)
+{
+    for (int counter = 0; counter < COUNTER_COUNT; counter++)
+    {
+        if (counters->fds[counter] != -1)
+        {
+            ioctl(counters->fds[counter], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+/*
+ * counters_stop - Stops counting.
+ */
+void counters_stop(counters_t *counters)
+{
+    for (int counter = 0; counter < COUNTER_COUNT; counter++)
+    {
+        if (counters->fds[counter] != -1)
+        {
+            ioctl(counters->fds[counter], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+}
+
+/*
+ * counters_read - Reads the counts so far into values. A counter that shared the
+ * PMU with others only ran part of the time, so its count is scaled up to the
+ * time it was enabled.
+ */
+void counters_read(counters_t *counters)
+{
+    for (int counter = 0; counter < COUNTER_COUNT; counter++)
+    {
+        uint64_t data[3]; /* value, time enabled, time running */
+        counters->values[counter] = 0;
+        if (counters->fds[counter] == -1 ||
+            read(counters->fds[counter], data, sizeof(data)) != sizeof(data) || data[2] == 0)
+        {
+            continue;
+        }
+        counters->values[counter] = data[2] < data[1] ? (uint64_t)((double)data[0] * data[1] / data[2]) : data[0];
+    }
+}
+
+/*
+ * counters_close - Closes every counter.
+ */
+void counters_close(counters_t *counters)
+{
+    for (int counter = 0; counter < COUNTER_COUNT; counter++)
+    {
+        if (counters->fds[counter] != -1)
+        {
+            close(counters->fds[counter]);
+            counters->fds[counter] = -1;
+        }
+    }
+    counters->opened = 0;
+}
+
+/*
+ * counters_name - Returns the name a counter is reported under.
+ */
+const char *counters_name(int counter)
+{
+    return events[counter].name;
+}
@@ -0,0 +1,45 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * counters.h - Hardware performance counters of the calling thread, opened
+ * through perf_event_open. Every counter is opened on its own, so that the
+ * ones the CPU or the kernel settings do not allow are simply left out.
+ **************************************************************************/
+
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* The events counted, in the order they are reported */
+enum {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_L1D_MISSES,
+    COUNTER_LLC_MISSES,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_DTLB_MISSES,
+    COUNTER_COUNT
+};
+
+/*
+ * counters_t - A set of counters. Counting only happens between counters_start
+ * and counters_stop, and adds up over every such stretch.
+ */
+typedef struct counters
+{
+    int fds[COUNTER_COUNT];          /* -1 for a counter that could not be opened */
+    uint64_t values[COUNTER_COUNT];  /* counts read by counters_read, scaled up if multiplexed */
+    int opened;                      /* counters opened */
+    int error;                       /* errno of the first counter that failed to open */
+} counters_t;
+
+int counters_open(counters_t *counters);
+void counters_start(counters_t *counters);
+void counters_stop(counters_t *counters);
+void counters_read(counters_t *counters);
+void counters_close(counters_t *counters);
+const char *counters_name(int counter);
+
+#endif
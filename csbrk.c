@@ -3,26 +3,80 @@
  * 
  * csbrk.c - A wrapper for sbrk system call. Used to keep track of calls
  * and introduce an upper limit to the amount of memory one can request at any
- * one time.
+ * one time. Also wraps mmap for large allocations, which are tracked the same way.
  * 
  * Copyright (c) 2021 M. Hinton. All rights reserved.
  * May not be used, modified, or copied without permission.
  **************************************************************************/
 
+#define _GNU_SOURCE /* for mremap */
 #include "csbrk.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <sys/mman.h>
 
 sbrk_block *sbrk_blocks = NULL;
-size_t sbrk_bytes;
+size_t sbrk_bytes;      /* the bytes taken from sbrk, and from mmap in its place, in total */
+size_t held_bytes;      /* the bytes held from sbrk and mmap right now */
+size_t peak_held_bytes; /* the most bytes held from sbrk and mmap at any one time */
+
+#ifdef TRACK_CSBRK
+/*
+ * track_held - Adds delta to the bytes currently held and updates the peak. Memory
+ * taken counts towards the total as well, which memory given back leaves alone.
+ */
+static void track_held(intptr_t delta)
+{
+    held_bytes += delta;
+    if (held_bytes > peak_held_bytes)
+    {
+        peak_held_bytes = held_bytes;
+    }
+    if (delta > 0)
+    {
+        sbrk_bytes += delta;
+    }
+}
+
+/*
+ * track_mapping - Records a mapping as a region of its own.
+ */
+static void track_mapping(void *address, size_t length)
+{
+    sbrk_block *temp = malloc(sizeof(sbrk_block));
+    temp->sbrk_start = (uint64_t)address;
+    temp->sbrk_end = (uint64_t)address + length;
+    temp->next = sbrk_blocks;
+    sbrk_blocks = temp;
+}
+
+/*
+ * untrack_mapping - Forgets the region recorded for the mapping at address.
+ */
+static void untrack_mapping(void *address, size_t length)
+{
+    sbrk_block **link = &sbrk_blocks;
+    while (*link != NULL && (*link)->sbrk_start != (uint64_t)address)
+    {
+        link = &(*link)->next;
+    }
+    if (*link != NULL)
+    {
+        sbrk_block *temp = *link;
+        *link = temp->next;
+        free(temp);
+    }
+}
+#endif
 
 /*
  * csbrk - A wrapper for sbrk. Places a maximum on the maximum amount of memory
  * that can be requested. If tracking is enabled, keeps track of the sbrk regions
- * allocated for correctness and utilization.
+ * allocated for correctness and utilization. A negative increment gives memory
+ * at the top of the last region back.
  */
 void *csbrk(intptr_t increment)
 {
@@ -35,7 +89,31 @@ void *csbrk(intptr_t increment)
 
     void *ret = sbrk(increment);
 #ifdef TRACK_CSBRK
-    sbrk_bytes += increment;
+    if (ret == (void *)-1)
+    {
+        return ret;
+    }
+    track_held(increment);
+    if (increment < 0)
+    {
+        // Shrink the region ending at the old break
+        sbrk_block **link = &sbrk_blocks;
+        while (*link != NULL && (*link)->sbrk_end != (uint64_t)ret)
+        {
+            link = &(*link)->next;
+        }
+        if (*link != NULL)
+        {
+            (*link)->sbrk_end += increment;
+            if ((*link)->sbrk_end <= (*link)->sbrk_start)
+            {
+                sbrk_block *temp = *link;
+                *link = temp->next;
+                free(temp);
+            }
+        }
+        return ret;
+    }
     uint64_t sbrk_start_temp = (uint64_t)ret;
     uint64_t sbrk_end_temp = sbrk_start_temp + (uint64_t)increment;
     bool coalesced = false;
@@ -63,6 +141,87 @@ void *csbrk(intptr_t increment)
     return ret;
 }
 
+/*
+ * cmmap - A wrapper for mmap, mapping length bytes of private anonymous memory.
+ * Returns NULL if an error occurred. If tracking is enabled, the mapping counts as
+ * an sbrk region until it is unmapped.
+ */
+void *cmmap(size_t length)
+{
+    void *ret = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ret == MAP_FAILED)
+    {
+        return NULL;
+    }
+#ifdef TRACK_CSBRK
+    track_mapping(ret, length);
+    track_held(length);
+#endif
+    return ret;
+}
+
+/*
+ * cmremap - A wrapper for mremap, resizing a mapping made by cmmap and moving it
+ * if it cannot grow in place. Returns NULL if an error occurred, in which case
+ * the mapping is unchanged.
+ */
+void *cmremap(void *address, size_t old_length, size_t new_length)
+{
+    void *ret = mremap(address, old_length, new_length, MREMAP_MAYMOVE);
+    if (ret == MAP_FAILED)
+    {
+        return NULL;
+    }
+#ifdef TRACK_CSBRK
+    untrack_mapping(address, old_length);
+    track_mapping(ret, new_length);
+    track_held((intptr_t)new_length - (intptr_t)old_length);
+#endif
+    return ret;
+}
+
+/*
+ * cmunmap - A wrapper for munmap, releasing a mapping made by cmmap.
+ */
+int cmunmap(void *address, size_t length)
+{
+#ifdef TRACK_CSBRK
+    untrack_mapping(address, length);
+    track_held(-(intptr_t)length);
+#endif
+    return munmap(address, length);
+}
+
+/*
+ * resident_bytes - Returns the number of bytes of the tracked regions that are
+ * currently backed by physical memory.
+ */
+size_t resident_bytes()
+{
+    size_t resident = 0;
+#ifdef TRACK_CSBRK
+    unsigned char pages[64];
+    for (sbrk_block *temp = sbrk_blocks; temp != NULL; temp = temp->next)
+    {
+        uint64_t start = temp->sbrk_start & ~((uint64_t)PAGESIZE - 1);
+        while (start < temp->sbrk_end)
+        {
+            size_t count = (temp->sbrk_end - start + PAGESIZE - 1) / PAGESIZE;
+            count = count > sizeof(pages) ? sizeof(pages) : count;
+            if (mincore((void *)start, count * PAGESIZE, pages) == 0)
+            {
+                for (size_t i = 0; i < count; i++)
+                {
+                    resident += (pages[i] & 0x1) * PAGESIZE;
+                }
+            }
+            start += count * PAGESIZE;
+        }
+    }
+#endif
+    return resident;
+}
+
 /*
  * check_malloc_output - Checks that a payload returned by umalloc falls within
  * one of the sbrk regions.
@@ -9,17 +9,31 @@
  * May not be used, modified, or copied without permission.
  **************************************************************************/
 
+#ifndef CSBRK_H
+#define CSBRK_H
+
 #include <stdint.h>
 #include <stdlib.h>
 
 #define PAGESIZE 4096
 
+struct uheap_struct;
+
 typedef struct sbrk_block_struct
 {
     uint64_t sbrk_start;
     uint64_t sbrk_end;
     struct sbrk_block_struct *next;
+    struct sbrk_block_struct *below; /* next lower region sharing this one's first page */
+    int kind;                        /* what the region holds, see region_kind_t */
+    struct uheap_struct *heap;       /* the umalloc heap owning the region */
 } sbrk_block;
 
 void *csbrk(intptr_t increment);
-int check_malloc_output(void *payload_start, size_t payload_length);
\ No newline at end of file
+void *cmmap(size_t length);
+void *cmremap(void *address, size_t old_length, size_t new_length);
+int cmunmap(void *address, size_t length);
+size_t resident_bytes();
+int check_malloc_output(void *payload_start, size_t payload_length);
+
+#endif
\ No newline at end of file
@@ -1,5 +1,6 @@
 #! /usr/bin/env python3
 import subprocess
+import json
 import statistics
 import os
 import math
@@ -8,21 +9,12 @@ from tabulate import tabulate
 utilization_target = 60.00
 performance_target = 1400
 
-def get_num_ops(trace_file):
-    f = open(trace_file, "r")
-    num_ops = int(f.readlines()[1])
-    return num_ops
-
 def performance_check(trace_file):
     N = 20
-    total_time = 0
-    num_ops = get_num_ops(trace_file)
-    for i in range(0, N):
-        performance = subprocess.run(["./performance", trace_file], universal_newlines=True, stdout=subprocess.PIPE)
-        if 'Success' not in performance.stdout:
-            return -1
-        total_time += int(performance.stdout.split()[1])
-    return (num_ops / (total_time // N)) * 1000
+    performance = subprocess.run(["./performance", "-n", str(N), "-w", "3", "-j", trace_file], universal_newlines=True, stdout=subprocess.PIPE)
+    if performance.returncode != 0:
+        return -1
+    return json.loads(performance.stdout)["ops_per_ms"]["median"]
 
 def utilization_check(trace_file):
     utilization = subprocess.run(["./runner", '-ru', trace_file], universal_newlines=True, stdout=subprocess.PIPE,stderr=subprocess.PIPE)
@@ -0,0 +1,120 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * latency.c - Log-bucketed latency histograms and the calibration of the
+ * cycle counter feeding them.
+ **************************************************************************/
+
+#include "latency.h"
+
+#define CALIBRATION_READINGS 10000
+#define CALIBRATION_NS 10000000 /* how long cycles are counted against the clock */
+
+/*
+ * clock_ns - Returns the monotonic clock in nanoseconds.
+ */
+static uint64_t clock_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * latency_calibrate - Measures the cost of reading the cycle counter, as the
+ * least two back to back readings ever differ by, and the length of a cycle
+ * by counting cycles for a few milliseconds of the monotonic clock.
+ */
+void latency_calibrate(latency_calibration_t *calibration)
+{
+    calibration->overhead = UINT64_MAX;
+    for (int i = 0; i < CALIBRATION_READINGS; i++)
+    {
+        uint64_t start = latency_now();
+        uint64_t delta = latency_now() - start;
+        if (delta < calibration->overhead)
+        {
+            calibration->overhead = delta;
+        }
+    }
+
+    uint64_t start_ns = clock_ns();
+    uint64_t start = latency_now();
+    uint64_t end_ns;
+    do
+    {
+        end_ns = clock_ns();
+    } while (end_ns - start_ns < CALIBRATION_NS);
+    uint64_t cycles = latency_now() - start;
+    calibration->ns_per_cycle = cycles > 0 ? (double)(end_ns - start_ns) / cycles : 1;
+}
+
+/*
+ * bucket_index - Returns the bucket counting value. Values below
+ * LATENCY_SUB_BUCKETS have a bucket each; larger ones are bucketed by their
+ * most significant bit and the LATENCY_SUB_BITS bits below it.
+ */
+static int bucket_index(uint64_t value)
+{
+    if (value < LATENCY_SUB_BUCKETS)
+    {
+        return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - LATENCY_SUB_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS + ((value >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/*
+ * bucket_high - Returns the largest value counted by the given bucket.
+ */
+static uint64_t bucket_high(int index)
+{
+    if (index < LATENCY_SUB_BUCKETS)
+    {
+        return index;
+    }
+    int shift = index / LATENCY_SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t)(LATENCY_SUB_BUCKETS + index % LATENCY_SUB_BUCKETS) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+/*
+ * latency_record - Counts value in the histogram.
+ */
+void latency_record(latency_histogram_t *histogram, uint64_t value)
+{
+    histogram->counts[bucket_index(value)]++;
+    histogram->count++;
+    if (value > histogram->max)
+    {
+        histogram->max = value;
+    }
+}
+
+/*
+ * latency_percentile - Returns the value that percentile percent of the recorded
+ * values do not exceed, rounded up to the end of its bucket but never past the
+ * largest value recorded. Returns 0 for an empty histogram.
+ */
+uint64_t latency_percentile(const latency_histogram_t *histogram, double percentile)
+{
+    // Nearest rank
+    double exact_rank = percentile / 100 * histogram->count;
+    uint64_t rank = (uint64_t)exact_rank;
+    if (rank < exact_rank || rank == 0)
+    {
+        rank++;
+    }
+    uint64_t seen = 0;
+    for (int index = 0; index < LATENCY_BUCKETS && histogram->count > 0; index++)
+    {
+        seen += histogram->counts[index];
+        if (seen >= rank)
+        {
+            uint64_t high = bucket_high(index);
+            return high < histogram->max ? high : histogram->max;
+        }
+    }
+    return histogram->max;
+}
@@ -0,0 +1,66 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * latency.h - Log-bucketed latency histograms in the style of HdrHistogram,
+ * fed from the CPU cycle counter. Each power of two range of values is split
+ * into LATENCY_SUB_BUCKETS linear buckets, so any value is known to within
+ * about 3% while a histogram spans the whole 64 bit range in a fixed array.
+ **************************************************************************/
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+/*
+ * latency_histogram_t - Counts of recorded values per bucket. Zeroed, it is an
+ * empty histogram.
+ */
+typedef struct latency_histogram
+{
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t count; /* values recorded */
+    uint64_t max;   /* largest value recorded */
+} latency_histogram_t;
+
+/*
+ * latency_calibration_t - What a reading of the cycle counter costs, and how
+ * long a cycle is, as measured by latency_calibrate.
+ */
+typedef struct latency_calibration
+{
+    uint64_t overhead; /* cycles two back to back readings are apart */
+    double ns_per_cycle;
+} latency_calibration_t;
+
+/*
+ * latency_now - Reads the cycle counter. The fence keeps earlier instructions
+ * from being counted after the reading. Falls back to the monotonic clock in
+ * nanoseconds where there is no counter.
+ */
+static inline uint64_t latency_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_lfence();
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+void latency_calibrate(latency_calibration_t *calibration);
+void latency_record(latency_histogram_t *histogram, uint64_t value);
+uint64_t latency_percentile(const latency_histogram_t *histogram, double percentile);
+
+#endif
@@ -8,38 +8,665 @@
  **************************************************************************/
 
 #include "umalloc.h"
+#include "uarena.h"
 #include "support.h"
+#include "latency.h"
+#include "counters.h"
+#include "backend.h"
+#include <math.h>
 
-static void run_trace(trace_t *trace) {
+#ifdef UMALLOC_THREADS
+#include <pthread.h>
+#endif
 
-    struct timespec start, end;
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    uinit();
+/* 
+ * usage - Explain the command line arguments
+ */
+static void usage(void) 
+{
+    fprintf(stderr, "Usage: performance [-h] [-a] [-s] [-j] [-l] [-p] [-b backends] [-n runs] [-w warmup] [-t threads] file\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-a         Allocate from an arena, reset whenever nothing is live, instead of freeing.\n");
+    fprintf(stderr, "\t-s         Leave the sbrk injected every 5 ops out of the timing.\n");
+    fprintf(stderr, "\t-j         Print the statistics as JSON.\n");
+    fprintf(stderr, "\t-l         Print latency percentiles of each op type and size class instead.\n");
+    fprintf(stderr, "\t-p         Count cycles, instructions, cache, branch and TLB misses per op.\n");
+    fprintf(stderr, "\t-b list    Replay with each comma separated backend (umalloc, libc or a shared\n");
+    fprintf(stderr, "\t           object path) and print a table comparing their throughput.\n");
+    fprintf(stderr, "\t-n runs    Time runs replays of the trace in this process and print statistics.\n");
+    fprintf(stderr, "\t-w warmup  Replay the trace warmup times before the timed runs.\n");
+    fprintf(stderr, "\t-t n       Replay the trace in n threads at once (thread-safe build only).\n");
+}
+
+/* Nanoseconds spent in injected sbrk calls during the current run, when excluded */
+static uint64_t sbrk_ns;
+static bool exclude_sbrk;
+
+/* The allocator the trace is replayed with */
+static const backend_t *backend;
+
+/* Hardware counters running during the replays of timed runs, NULL if not requested */
+static counters_t *counters;
+
+/* 
+ * now_ns - Returns the monotonic clock in nanoseconds.
+ */
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* 
+ * sbrk_gap - Breaks the contiguity of the heap with an sbrk, keeping the time it
+ * takes out of the run if requested.
+ */
+static void sbrk_gap(void) {
+    if (!exclude_sbrk) {
+        sbrk(4096);
+        return;
+    }
+    uint64_t start = now_ns();
+    sbrk(4096);
+    sbrk_ns += now_ns() - start;
+}
+
+/* 
+ * backend_aligned_alloc - Allocates an aligned payload with the backend, or a
+ * plain one if the backend has no aligned allocation.
+ */
+static inline void *backend_aligned_alloc(size_t alignment, size_t size) {
+    if (backend->aligned_alloc == NULL)
+        return backend->malloc(size);
+    return backend->aligned_alloc(alignment, size);
+}
+
+/* 
+ * replay_trace - Runs every op of the trace with the backend, keeping the returned
+ * payloads in blocks. Breaks the contiguity of the heap with an sbrk every 5 ops
+ * if requested.
+ */
+static void replay_trace(trace_t *trace, allocated_block_t *blocks, int inject_sbrk) {
+    for(size_t curr_op = 0; curr_op < trace->num_ops; curr_op++) {
+        if (inject_sbrk && curr_op % 5 == 0) {
+            sbrk_gap();
+        }
+        traceop_t op = trace->ops[curr_op];
+        if (op.type == ALLOC) {
+            blocks[op.index].payload = backend->malloc(op.size);
+        } else if (op.type == ALIGNED) {
+            blocks[op.index].payload = backend_aligned_alloc(OP_ALIGNMENT(op), op.size);
+        } else if (op.type == REALLOC) {
+            blocks[op.index].payload = backend->realloc(blocks[op.index].payload, op.size);
+        } else {
+            backend->free(blocks[op.index].payload);
+            blocks[op.index].payload = NULL;
+        }
+    }
+}
+
+/* 
+ * replay_trace_arena - Runs every op of the trace against an arena. Frees only
+ * count the live payloads, and the arena is reset each time none is left, so a
+ * request-scoped trace releases its memory once per request. Reallocs copy the
+ * payload into a new object, or free it when reallocating to zero bytes. Breaks the contiguity of the heap like replay_trace.
+ */
+static void replay_trace_arena(trace_t *trace, allocated_block_t *blocks, uarena_t *arena) {
+    size_t live = 0;
+    for(size_t curr_op = 0; curr_op < trace->num_ops; curr_op++) {
+        if (curr_op % 5 == 0) {
+            sbrk_gap();
+        }
+        traceop_t op = trace->ops[curr_op];
+        allocated_block_t *block = &blocks[op.index];
+        if (op.type == ALLOC || op.type == ALIGNED) {
+            // Arena objects only have the umalloc alignment
+            block->payload = uarena_alloc(arena, op.size);
+            block->block_size = op.size;
+            live++;
+        } else if (op.type == REALLOC && (op.size > 0 || block->payload == NULL)) {
+            void *payload = uarena_alloc(arena, op.size);
+            if (payload != NULL && block->payload != NULL) {
+                memcpy(payload, block->payload, block->block_size < op.size ? block->block_size : op.size);
+            }
+            block->payload = payload;
+            block->block_size = op.size;
+        } else {
+            block->payload = NULL;
+            if (--live == 0) {
+                uarena_reset(arena);
+            }
+        }
+    }
+}
+
+/* 
+ * init_backend - Readies a fresh heap of the backend, if it has one.
+ */
+static void init_backend(void) {
+    if (backend->init != NULL && backend->init() == -1)
+        appl_error("The backend failed to initialize");
+}
+
+/* 
+ * release_blocks - Frees the payloads a replay left live, so that backends with
+ * no heap to reset do not carry them into the next run.
+ */
+static void release_blocks(trace_t *trace) {
+    for (int id = 0; id < trace->num_ids; id++) {
+        if (trace->blocks[id].payload != NULL) {
+            backend->free(trace->blocks[id].payload);
+            trace->blocks[id].payload = NULL;
+        }
+    }
+}
+
+/* 
+ * run_trace - Replays the trace once on a freshly initialized heap and returns the
+ * nanoseconds it took, leaving out the injected sbrk calls if requested. The
+ * payloads left live are freed after the timing.
+ */
+static uint64_t run_trace(trace_t *trace, bool use_arena) {
+    memset(trace->blocks, 0, trace->num_ids * sizeof(allocated_block_t));
+    sbrk_ns = 0;
+    uint64_t start = now_ns();
+    init_backend();
+    if (counters != NULL) {
+        counters_start(counters);
+    }
+    if (use_arena) {
+        uarena_options_t options = {.keep_chunks = true};
+        uarena_t *arena = uarena_create(&options);
+        if (arena == NULL)
+            appl_error("Failed to create the arena");
+        replay_trace_arena(trace, trace->blocks, arena);
+        uarena_destroy(arena);
+    } else {
+        replay_trace(trace, trace->blocks, 1);
+    }
+    if (counters != NULL) {
+        counters_stop(counters);
+    }
+    uint64_t ns = now_ns() - start - sbrk_ns;
+    if (!use_arena) {
+        release_blocks(trace);
+    }
+    return ns;
+}
+
+/* 
+ * print_counters - Prints the hardware counts divided by ops, as a line of text
+ * or as members of a JSON object.
+ */
+static void print_counters(uint64_t ops, bool json) {
+    counters_read(counters);
+    printf(json ? ", \"counters_per_op\": {" : "Per op:");
+    bool first = true;
+    for (int counter = 0; counter < COUNTER_COUNT; counter++) {
+        if (counters->fds[counter] == -1)
+            continue;
+        double per_op = (double)counters->values[counter] / ops;
+        if (json) {
+            printf("%s\"%s\": %.2f", first ? "" : ", ", counters_name(counter), per_op);
+        } else {
+            printf("%s %.2f %s", first ? "" : ",", per_op, counters_name(counter));
+        }
+        first = false;
+    }
+    if (counters->fds[COUNTER_CYCLES] != -1 && counters->fds[COUNTER_INSTRUCTIONS] != -1 &&
+        counters->values[COUNTER_CYCLES] > 0) {
+        double ipc = (double)counters->values[COUNTER_INSTRUCTIONS] / counters->values[COUNTER_CYCLES];
+        printf(json ? ", \"ipc\": %.2f" : ", %.2f IPC", ipc);
+    }
+    printf(json ? "}" : "\n");
+}
+
+/* 
+ * compare_doubles - qsort comparator for ascending doubles.
+ */
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Throughput of the timed runs, in ops per millisecond */
+typedef struct {
+    double min, median, p95, mean, stddev;
+} throughput_t;
+
+/* 
+ * time_runs - Replays the trace warmup times untimed, then runs times, and works
+ * out the min, median, 95th percentile, mean and standard deviation of the
+ * throughput of the timed runs.
+ */
+static void time_runs(trace_t *trace, bool use_arena, int warmup, int runs, throughput_t *throughput) {
+    counters_t *timed_counters = counters;
+    counters = NULL;
+    for (int i = 0; i < warmup; i++) {
+        run_trace(trace, use_arena);
+    }
+    counters = timed_counters;
+    double *ops_per_ms = calloc(runs, sizeof(double));
+    if (ops_per_ms == NULL)
+        appl_error("Failed to allocate run array");
+    double sum = 0;
+    for (int i = 0; i < runs; i++) {
+        uint64_t ns = run_trace(trace, use_arena);
+        ops_per_ms[i] = trace->num_ops * 1000000.0 / (ns > 0 ? ns : 1);
+        sum += ops_per_ms[i];
+    }
+    double mean = sum / runs;
+    double squares = 0;
+    for (int i = 0; i < runs; i++) {
+        squares += (ops_per_ms[i] - mean) * (ops_per_ms[i] - mean);
+    }
+    qsort(ops_per_ms, runs, sizeof(double), compare_doubles);
+    throughput->min = ops_per_ms[0];
+    throughput->median = runs % 2 ? ops_per_ms[runs / 2] : (ops_per_ms[runs / 2 - 1] + ops_per_ms[runs / 2]) / 2;
+    // Nearest rank
+    throughput->p95 = ops_per_ms[(int)ceil(0.95 * runs) - 1];
+    throughput->mean = mean;
+    throughput->stddev = runs > 1 ? sqrt(squares / (runs - 1)) : 0;
+    free(ops_per_ms);
+}
+
+/* 
+ * run_trace_repeated - Times the runs of the trace and prints the statistics of
+ * their throughput in ops per millisecond, as text or JSON.
+ */
+static void run_trace_repeated(trace_t *trace, char *name, bool use_arena, int warmup, int runs, bool json) {
+    throughput_t throughput;
+    time_runs(trace, use_arena, warmup, runs, &throughput);
+    double mean = throughput.mean, stddev = throughput.stddev;
+    if (json) {
+        printf("{\"trace\": \"%s\", \"backend\": \"%s\", \"ops\": %d, \"runs\": %d, \"warmup\": %d, "
+               "\"arena\": %s, \"exclude_sbrk\": %s, \"ops_per_ms\": {\"min\": %.2f, \"median\": %.2f, "
+               "\"p95\": %.2f, \"mean\": %.2f, \"stddev\": %.2f}",
+               name, backend->name, trace->num_ops, runs, warmup, use_arena ? "true" : "false",
+               exclude_sbrk ? "true" : "false", throughput.min, throughput.median, throughput.p95, mean, stddev);
+        if (counters != NULL) {
+            print_counters((uint64_t)trace->num_ops * runs, true);
+        }
+        printf("}\n");
+    } else {
+        printf("%s: %d ops, %d runs after %d warmup runs%s\n", name, trace->num_ops, runs, warmup,
+               exclude_sbrk ? ", sbrk excluded" : "");
+        printf("Ops/ms: min %.2f, median %.2f, p95 %.2f, mean %.2f, stddev %.2f (%.1f%%)\n",
+               throughput.min, throughput.median, throughput.p95, mean, stddev, mean > 0 ? 100 * stddev / mean : 0);
+        if (counters != NULL) {
+            print_counters((uint64_t)trace->num_ops * runs, false);
+        }
+    }
+}
+
+/* 
+ * compare_backends - Times the runs of the trace with each backend in turn and
+ * prints a table of their throughput in ops per millisecond, the median also
+ * relative to that of the first backend, or one JSON object per backend. The
+ * hardware counters start from zero for every backend.
+ */
+static void compare_backends(trace_t *trace, char *name, const backend_t **backends, int count,
+                             int warmup, int runs, bool json) {
+    if (!json) {
+        printf("%s: %d ops, %d runs after %d warmup runs%s\n", name, trace->num_ops, runs, warmup,
+               exclude_sbrk ? ", sbrk excluded" : "");
+        printf("%-24s %10s %10s %10s %10s %7s %8s\n", "backend", "min", "median", "p95", "mean", "stddev", "relative");
+    }
+    double first_median = 0;
+    for (int i = 0; i < count; i++) {
+        backend = backends[i];
+        if (counters != NULL) {
+            counters_close(counters);
+            counters_open(counters);
+        }
+        if (json) {
+            run_trace_repeated(trace, name, false, warmup, runs, true);
+            continue;
+        }
+        throughput_t throughput;
+        time_runs(trace, false, warmup, runs, &throughput);
+        if (i == 0) {
+            first_median = throughput.median;
+        }
+        printf("%-24s %10.2f %10.2f %10.2f %10.2f %6.1f%% %7.2fx\n", backend->name, throughput.min,
+               throughput.median, throughput.p95, throughput.mean,
+               throughput.mean > 0 ? 100 * throughput.stddev / throughput.mean : 0,
+               first_median > 0 ? throughput.median / first_median : 0);
+        if (counters != NULL) {
+            printf("%-24s ", "");
+            print_counters((uint64_t)trace->num_ops * runs, false);
+        }
+    }
+}
+
+/* The size classes latencies are broken down by, after the path umalloc takes */
+enum {CLASS_SLAB, CLASS_QUICK, CLASS_BINS, CLASS_TREE, CLASS_MMAP, CLASS_COUNT};
+static const char *class_names[CLASS_COUNT] = {"slab", "quick", "bins", "tree", "mmap"};
+
+#define OP_COUNT (ALIGNED + 1)
+static const char *op_names[OP_COUNT] = {
+    [ALLOC] = "malloc", [FREE] = "free", [REALLOC] = "realloc", [ALIGNED] = "aligned_alloc"
+};
+
+/* Latency histograms in cycles per op type, over all sizes and per size class */
+typedef struct {
+    latency_histogram_t all[OP_COUNT];
+    latency_histogram_t by_class[OP_COUNT][CLASS_COUNT];
+} latencies_t;
+
+/* 
+ * size_class - Returns the size class of a request of size bytes. Slabs and
+ * mappings are picked by the request size, the rest by the size of the block,
+ * header included, like umalloc does.
+ */
+static int size_class(size_t size) {
+    if (size <= SLAB_MAX_SIZE)
+        return CLASS_SLAB;
+    if (size >= MMAP_THRESHOLD)
+        return CLASS_MMAP;
+    size_t block_size = get_block_size(size);
+    if (block_size <= QUICK_MAX_SIZE)
+        return CLASS_QUICK;
+    if (block_size < TREE_MIN_SIZE)
+        return CLASS_BINS;
+    return CLASS_TREE;
+}
+
+/* 
+ * replay_trace_latency - Runs every op of the trace like replay_trace, reading the
+ * cycle counter around each call and recording its cycles less the overhead of
+ * the readings. Frees are classed by the size of the block they free.
+ */
+static void replay_trace_latency(trace_t *trace, allocated_block_t *blocks, latencies_t *latencies, uint64_t overhead) {
     for(size_t curr_op = 0; curr_op < trace->num_ops; curr_op++) {
         if (curr_op % 5 == 0) {
             sbrk(4096);
         }
         traceop_t op = trace->ops[curr_op];
+        allocated_block_t *block = &blocks[op.index];
+        size_t size = op.type == FREE ? block->block_size : op.size;
+        uint64_t start = latency_now();
         if (op.type == ALLOC) {
-            trace->blocks[op.index].payload = umalloc(op.size);
+            block->payload = backend->malloc(op.size);
+        } else if (op.type == ALIGNED) {
+            block->payload = backend_aligned_alloc(OP_ALIGNMENT(op), op.size);
+        } else if (op.type == REALLOC) {
+            block->payload = backend->realloc(block->payload, op.size);
         } else {
-            ufree(trace->blocks[op.index].payload);
+            backend->free(block->payload);
+        }
+        uint64_t cycles = latency_now() - start;
+        cycles = cycles > overhead ? cycles - overhead : 0;
+        latency_record(&latencies->all[op.type], cycles);
+        latency_record(&latencies->by_class[op.type][size_class(size)], cycles);
+        if (op.type == FREE) {
+            block->payload = NULL;
+            block->block_size = 0;
+        } else {
+            block->block_size = op.size;
+        }
+    }
+}
+
+/* 
+ * print_latency - Prints the percentiles of one histogram in nanoseconds, as a
+ * table row or a JSON object.
+ */
+static void print_latency(latency_histogram_t *histogram, const char *op, const char *class,
+                          double ns_per_cycle, bool json, bool first) {
+    double p50 = latency_percentile(histogram, 50) * ns_per_cycle;
+    double p99 = latency_percentile(histogram, 99) * ns_per_cycle;
+    double p999 = latency_percentile(histogram, 99.9) * ns_per_cycle;
+    double max = histogram->max * ns_per_cycle;
+    if (json) {
+        printf("%s{\"op\": \"%s\", \"class\": \"%s\", \"count\": %lu, \"p50\": %.0f, "
+               "\"p99\": %.0f, \"p99.9\": %.0f, \"max\": %.0f}",
+               first ? "" : ", ", op, class, histogram->count, p50, p99, p999, max);
+    } else {
+        printf("%-15s %-6s %9lu %9.0f %9.0f %9.0f %9.0f\n", op, class, histogram->count, p50, p99, p999, max);
+    }
+}
+
+/* 
+ * run_trace_latency - Replays the trace warmup times untimed, then runs times on
+ * a fresh heap each, timing every op, and prints the p50, p99, p99.9 and max
+ * latency per op type, over all sizes and per size class, in nanoseconds.
+ */
+static void run_trace_latency(trace_t *trace, char *name, int warmup, int runs, bool json) {
+    latency_calibration_t calibration;
+    latency_calibrate(&calibration);
+    latencies_t *latencies = calloc(1, sizeof(latencies_t));
+    if (latencies == NULL)
+        appl_error("Failed to allocate the histograms");
+    for (int i = 0; i < warmup; i++) {
+        run_trace(trace, false);
+    }
+    for (int i = 0; i < runs; i++) {
+        memset(trace->blocks, 0, trace->num_ids * sizeof(allocated_block_t));
+        init_backend();
+        replay_trace_latency(trace, trace->blocks, latencies, calibration.overhead);
+        release_blocks(trace);
+    }
+
+    double overhead_ns = calibration.overhead * calibration.ns_per_cycle;
+    if (json) {
+        printf("{\"trace\": \"%s\", \"backend\": \"%s\", \"ops\": %d, \"runs\": %d, \"warmup\": %d, "
+               "\"overhead_ns\": %.1f, \"latency_ns\": [", name, backend->name, trace->num_ops, runs, warmup,
+               overhead_ns);
+    } else {
+        printf("%s with %s: %d ops, %d runs after %d warmup runs, %.1f ns of timer overhead subtracted\n",
+               name, backend->name, trace->num_ops, runs, warmup, overhead_ns);
+        printf("%-15s %-6s %9s %9s %9s %9s %9s\n", "op", "class", "count", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+    }
+    bool first = true;
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (latencies->all[op].count == 0)
+            continue;
+        print_latency(&latencies->all[op], op_names[op], "all", calibration.ns_per_cycle, json, first);
+        first = false;
+        for (int class = 0; class < CLASS_COUNT; class++) {
+            if (latencies->by_class[op][class].count > 0) {
+                print_latency(&latencies->by_class[op][class], op_names[op], class_names[class],
+                              calibration.ns_per_cycle, json, false);
+            }
         }
     }
+    if (json) {
+        printf("]}\n");
+    }
+    free(latencies);
+}
+
+#ifdef UMALLOC_THREADS
+/* Holds the arguments of one replay thread */
+typedef struct {
+    pthread_t thread;
+    trace_t *trace;
+    allocated_block_t *blocks;
+} replay_thread_t;
+
+/* 
+ * replay_thread - Thread body replaying the trace into the thread's own blocks.
+ * The sbrk injection is skipped, since sbrk itself is not thread safe.
+ */
+static void *replay_thread(void *arg) {
+    replay_thread_t *replay = arg;
+    replay_trace(replay->trace, replay->blocks, 0);
+    return NULL;
+}
+
+/* 
+ * run_trace_threads - Replays the trace in num_threads threads at once, each with
+ * its own copy of the blocks, and reports the wall clock time for all of them.
+ */
+static void run_trace_threads(trace_t *trace, int num_threads) {
+    replay_thread_t *threads = calloc(num_threads, sizeof(replay_thread_t));
+    if (threads == NULL)
+        appl_error("Failed to allocate thread array");
+    for (int i = 0; i < num_threads; i++) {
+        threads[i].trace = trace;
+        threads[i].blocks = calloc(trace->num_ids, sizeof(allocated_block_t));
+        if (threads[i].blocks == NULL)
+            appl_error("Failed to allocate block array");
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uinit();
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i].thread, NULL, replay_thread, &threads[i]) != 0)
+            appl_error("Failed to create replay thread");
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
     clock_gettime(CLOCK_MONOTONIC, &end);
     uint64_t delta_us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
     printf("Success: %ld", delta_us);
+
+    for (int i = 0; i < num_threads; i++) {
+        free(threads[i].blocks);
+    }
+    free(threads);
 }
+#endif
 
+int main(int argc, char **argv) { 
+    int c;
+    int num_threads = 1;
+    bool arena = false;
+    bool json = false;
+    bool latency = false;
+    bool hardware = false;
+    int runs = 0;
+    int warmup = 0;
+    const backend_t *backends[BACKEND_MAX];
+    int backend_count = 0;
 
+    while ((c = getopt(argc, argv, "hasjlpb:n:w:t:")) != EOF) {
+        switch (c) {
+        case 'h':
+            usage();
+            exit(0);
+        case 'a':
+            arena = true;
+            break;
+        case 's':
+            exclude_sbrk = true;
+            break;
+        case 'j':
+            json = true;
+            break;
+        case 'l':
+            latency = true;
+            break;
+        case 'p':
+            hardware = true;
+            break;
+        case 'b':
+            for (char *name = strtok(optarg, ","); name != NULL; name = strtok(NULL, ",")) {
+                if (backend_count == BACKEND_MAX)
+                    appl_error("Too many backends.");
+                backends[backend_count] = backend_load(name);
+                if (backends[backend_count] == NULL)
+                    appl_error("Failed to load a backend.");
+                backend_count++;
+            }
+            break;
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
 
-int main(int argc, char **argv) { 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: performance file\n");
+    if (optind >= argc) {
+        usage();
         appl_error("No File parameter provided.");
     }
-    trace_t *trace = read_trace(argv[1], 0);
-    run_trace(trace);
+    if (num_threads < 1) {
+        usage();
+        appl_error("The thread count must be positive.");
+    }
+    if (arena && num_threads > 1) {
+        appl_error("Arenas are not thread safe, -a cannot be combined with -t.");
+    }
+    if (backend_count > 0 && (arena || num_threads > 1)) {
+        appl_error("Arenas and threads run on umalloc, -a and -t cannot be combined with -b.");
+    }
+    if (runs < 0 || warmup < 0) {
+        usage();
+        appl_error("The run and warmup counts cannot be negative.");
+    }
+    bool repeated = runs > 0 || warmup > 0 || json || latency || backend_count > 1;
+    if (repeated && num_threads > 1) {
+        appl_error("Repeated runs time one thread, -n, -w, -j and -l cannot be combined with -t.");
+    }
+    if (latency && arena) {
+        appl_error("Latencies are only measured for the backends, -l cannot be combined with -a.");
+    }
+    if (hardware && (latency || num_threads > 1)) {
+        appl_error("Counters follow the replay of one thread, -p cannot be combined with -l or -t.");
+    }
+#ifndef UMALLOC_THREADS
+    if (num_threads > 1) {
+        appl_error("Multi-threaded replay needs the thread-safe build (performance_mt).");
+    }
+#endif
+
+    if (backend_count == 0) {
+        backends[backend_count++] = backend_load("umalloc");
+    }
+    backend = backends[0];
+
+    trace_t *trace = read_trace(argv[optind], 0);
+    counters_t hardware_counters;
+    if (hardware) {
+        if (counters_open(&hardware_counters) > 0) {
+            counters = &hardware_counters;
+        } else {
+            fprintf(stderr, "Hardware counters are unavailable (%s), running without them.\n",
+                    strerror(hardware_counters.error));
+        }
+    }
+#ifdef UMALLOC_THREADS
+    if (num_threads > 1) {
+        run_trace_threads(trace, num_threads);
+        free_trace(trace);
+        return 0;
+    }
+#endif
+    if (latency) {
+        for (int i = 0; i < backend_count; i++) {
+            backend = backends[i];
+            run_trace_latency(trace, argv[optind], warmup, runs > 0 ? runs : 1, json);
+        }
+    } else if (backend_count > 1) {
+        compare_backends(trace, argv[optind], backends, backend_count, warmup, runs > 0 ? runs : 1, json);
+    } else if (repeated) {
+        run_trace_repeated(trace, argv[optind], arena, warmup, runs > 0 ? runs : 1, json);
+    } else {
+        printf("Success: %ld", run_trace(trace, arena) / 1000);
+        if (counters != NULL) {
+            printf("\n");
+            print_counters(trace->num_ops, false);
+        }
+    }
+    if (counters != NULL) {
+        counters_close(counters);
+    }
+    for (int i = 0; i < backend_count; i++) {
+        backend_unload(backends[i]);
+    }
     free_trace(trace);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,147 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * pool_performance.c - Microbenchmark of the fixed-size object pools against
+ * umalloc and ufree, churning a working set of objects of one size
+ **************************************************************************/
+
+#include "umalloc.h"
+#include "upool.h"
+#include "support.h"
+
+#define DEFAULT_OPS 1000000
+#define DEFAULT_LIVE 1000
+
+/* The object sizes measured, from the slab classes up to the heap blocks */
+static const size_t object_sizes[] = {24, 64, 200, 1000};
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: pool_performance [-h] [-n ops] [-l live] [-r]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-n ops     Number of allocations and frees per run (default %d).\n", DEFAULT_OPS);
+    fprintf(stderr, "\t-l live    Number of objects the runs keep track of (default %d).\n", DEFAULT_LIVE);
+    fprintf(stderr, "\t-r         Reserve the pool objects up front.\n");
+}
+
+/*
+ * next_slot - Returns a pseudo-random slot, the same sequence for every run.
+ */
+static size_t next_slot(uint64_t *state, size_t live) {
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (*state >> 33) % live;
+}
+
+/*
+ * elapsed_us - Returns the microseconds from start to now.
+ */
+static uint64_t elapsed_us(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1000000 + (end.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*
+ * run_umalloc - Allocates an object of size bytes into a random slot, or frees
+ * the object already in it, ops times with umalloc and ufree.
+ */
+static uint64_t run_umalloc(void **slots, size_t live, size_t ops, size_t size) {
+    uint64_t state = 429;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t op = 0; op < ops; op++) {
+        size_t slot = next_slot(&state, live);
+        if (slots[slot] != NULL) {
+            ufree(slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            slots[slot] = umalloc(size);
+            if (slots[slot] == NULL)
+                appl_error("umalloc failed");
+            *(size_t *)slots[slot] = op;
+        }
+    }
+    for (size_t slot = 0; slot < live; slot++) {
+        ufree(slots[slot]);
+        slots[slot] = NULL;
+    }
+    return elapsed_us(&start);
+}
+
+/*
+ * run_upool - Does the same as run_umalloc with a pool of objects of size bytes,
+ * optionally reserving one object per slot first.
+ */
+static uint64_t run_upool(void **slots, size_t live, size_t ops, size_t size, bool reserve) {
+    uint64_t state = 429;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    upool_t *pool = upool_create(size, 0);
+    if (pool == NULL || (reserve && upool_reserve(pool, live) == -1))
+        appl_error("Failed to create the pool");
+    for (size_t op = 0; op < ops; op++) {
+        size_t slot = next_slot(&state, live);
+        if (slots[slot] != NULL) {
+            upool_free(pool, slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            slots[slot] = upool_alloc(pool);
+            if (slots[slot] == NULL)
+                appl_error("upool_alloc failed");
+            *(size_t *)slots[slot] = op;
+        }
+    }
+    for (size_t slot = 0; slot < live; slot++) {
+        slots[slot] = NULL;
+    }
+    upool_destroy(pool);
+    return elapsed_us(&start);
+}
+
+int main(int argc, char **argv) {
+    int c;
+    size_t ops = DEFAULT_OPS;
+    size_t live = DEFAULT_LIVE;
+    bool reserve = false;
+
+    while ((c = getopt(argc, argv, "hn:l:r")) != EOF) {
+        switch (c) {
+        case 'h':
+            usage();
+            exit(0);
+        case 'n':
+            ops = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            live = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            reserve = true;
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (live == 0) {
+        usage();
+        appl_error("The live object count must be positive.");
+    }
+
+    void **slots = calloc(live, sizeof(void *));
+    if (slots == NULL)
+        appl_error("Failed to allocate slot array");
+    uinit();
+    for (size_t i = 0; i < sizeof(object_sizes) / sizeof(object_sizes[0]); i++) {
+        size_t size = object_sizes[i];
+        uint64_t umalloc_us = run_umalloc(slots, live, ops, size);
+        uint64_t upool_us = run_upool(slots, live, ops, size, reserve);
+        printf("%4lu bytes: umalloc %lu us, upool %lu us\n", size, umalloc_us, upool_us);
+    }
+    free(slots);
+    return 0;
+}
@@ -11,11 +11,14 @@
 #include "csbrk.h"
 #include "support.h"
 #include "check_heap.h"
+#include "backend.h"
 #include <sys/mman.h>
 
 int verbose = 0;
-char msg[MAXLINE];      /* for whenever we need to compose an error message */
+static char msg[MAXLINE]; /* for whenever we need to compose an error message */
 extern size_t sbrk_bytes;
+extern size_t held_bytes;
+extern size_t peak_held_bytes;
 extern const char author[];
 
 /* 
@@ -23,13 +26,15 @@ extern const char author[];
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: runner [-rhvuc] file\n");
+    fprintf(stderr, "Usage: runner [-rhvuc] [-b backends] file\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-r         Run the trace to completion (bypass interface).\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-v         Print additional debug info.\n");
     fprintf(stderr, "\t-u         Display heap utilization.\n");
     fprintf(stderr, "\t-c         Runs the user provided heap check after every op.\n");
+    fprintf(stderr, "\t-b list    Run the trace with each comma separated backend (umalloc, libc or a\n");
+    fprintf(stderr, "\t           shared object path) and print a table comparing their utilization.\n");
 }
 
 /* 
@@ -82,6 +87,54 @@ static int check_correctness(trace_t *trace, size_t curr_op) {
     return 0;
 }
 
+/* 
+ * check_payload - Checks that a payload returned by the named umalloc function is
+ * aligned to alignment bytes and rests within the sbrk range.
+ */
+static int check_payload(allocated_block_t *block, size_t alignment, size_t curr_op, char *name) {
+    if (((size_t)block->payload) % alignment != 0) {
+        sprintf(msg, "%s returned an unaligned payload.", name);
+        malloc_error(curr_op, msg);
+        return -1;
+    }
+
+    if(check_malloc_output(block->payload, block->block_size) == -1) {
+        printf("line %ld: %s allocated a block out of bounds.\n", LINENUM(curr_op), name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* 
+ * check_huge_requests - Checks that requests too large to ever be served return
+ * NULL, rather than a block smaller than asked for once the sizing wraps around.
+ * Runs after the trace, since the block it reallocates would count against the
+ * utilization.
+ */
+static int check_huge_requests(void) {
+    static const size_t sizes[] = {SIZE_MAX, SIZE_MAX - 100, SIZE_MAX - PAGESIZE};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if (umalloc(sizes[i]) != NULL) {
+            sprintf(msg, "umalloc(%lu) did not fail.", sizes[i]);
+            malloc_error(-3, msg);
+            return -1;
+        }
+    }
+    if (ualigned_alloc(64, SIZE_MAX - 10) != NULL || ualigned_alloc((size_t)1 << 63, 100) != NULL) {
+        malloc_error(-3, "ualigned_alloc of a huge size or alignment did not fail.");
+        return -1;
+    }
+    size_t *block = umalloc(sizeof(size_t));
+    *block = 429;
+    if (urealloc(block, SIZE_MAX - 10) != NULL || *block != 429) {
+        malloc_error(-3, "urealloc to a huge size did not fail and keep the block.");
+        return -1;
+    }
+    ufree(block);
+    return 0;
+}
+
 size_t curr_bytes_in_use;
 size_t max_bytes_in_use;
 
@@ -89,7 +142,8 @@ size_t max_bytes_in_use;
  * UTILIZATION_SCORE - the utilization score represents how well the umalloc
  * package uses the bytes requested from sbrk. For example, if 100 bytes are
  * requested from sbrk, and the user requested 80 bytes, there will be a 
- * utilization score of 80%.
+ * utilization score of 80%. Mappings made in place of sbrk count as requested
+ * too, and memory given back does not lower the total.
  */
 #define UTILIZATION_SCORE 100.0 * max_bytes_in_use / sbrk_bytes
 
@@ -107,33 +161,81 @@ static int run_trace_line(trace_t *trace, size_t curr_op, int utilization, int r
         mprotect(ret, 4096, PROT_NONE);
     }
     traceop_t op = trace->ops[curr_op];
-    if (op.type == ALLOC) {
+    if (op.type == ALLOC || op.type == ALIGNED) {
         trace->blocks[op.index].is_allocated = true;
         trace->blocks[op.index].content_val = curr_op;
         trace->blocks[op.index].block_size = op.size;
 
-        if (verbose) {
-            printf("line %ld: umalloc: id %d, Allocating %d bytes\n", LINENUM(curr_op), op.index, op.size);
+        char *name = "umalloc";
+        size_t alignment = ALIGNMENT;
+        if (op.type == ALIGNED) {
+            if (verbose) {
+                printf("line %ld: ualigned_alloc: id %d, Allocating %d bytes aligned to %lu\n", LINENUM(curr_op), op.index, op.size, OP_ALIGNMENT(op));
+            }
+            name = "ualigned_alloc";
+            alignment = OP_ALIGNMENT(op) > ALIGNMENT ? OP_ALIGNMENT(op) : ALIGNMENT;
+            trace->blocks[op.index].payload = ualigned_alloc(OP_ALIGNMENT(op), op.size);
+        } else {
+            if (verbose) {
+                printf("line %ld: umalloc: id %d, Allocating %d bytes\n", LINENUM(curr_op), op.index, op.size);
+            }
+            trace->blocks[op.index].payload = umalloc(op.size);
         }
-
-        trace->blocks[op.index].payload = umalloc(op.size);
         curr_bytes_in_use += op.size;
         if ( trace->blocks[op.index].payload == NULL) {
-            malloc_error(curr_op, "umalloc failed.");
+            sprintf(msg, "%s failed.", name);
+            malloc_error(curr_op, msg);
             return -1;
         }
 
-        if (((size_t)trace->blocks[op.index].payload) % ALIGNMENT != 0) {
-            malloc_error(curr_op, "umalloc returned an unaligned payload.");
+        if (check_payload(&trace->blocks[op.index], alignment, curr_op, name) == -1) {
             return -1;
         }
 
-        if(check_malloc_output(trace->blocks[op.index].payload, trace->blocks[op.index].block_size) == -1) {
-            printf("line %ld: umalloc allocated a block out of bounds.\n", LINENUM(curr_op));
-            return -1;
+        copy_id((size_t*) trace->blocks[op.index].payload, trace->blocks[op.index].block_size, curr_op);
+    } else if (op.type == REALLOC) {
+        allocated_block_t *block = &trace->blocks[op.index];
+        if (!block->is_allocated) {
+            // Reallocating a block that is not allocated is a plain allocation
+            block->payload = NULL;
+            block->block_size = 0;
         }
 
-        copy_id((size_t*) trace->blocks[op.index].payload, trace->blocks[op.index].block_size, curr_op);
+        if (verbose) {
+            printf("line %ld: urealloc: id %d, Reallocating %lu to %d bytes\n", LINENUM(curr_op), op.index, block->block_size, op.size);
+        }
+
+        void *payload = urealloc(block->payload, op.size);
+        if (payload == NULL && op.size == 0) {
+            // Reallocating to zero bytes frees the block
+            curr_bytes_in_use -= block->block_size;
+            block->is_allocated = false;
+            block->payload = NULL;
+            block->block_size = 0;
+        } else {
+            if (payload == NULL) {
+                malloc_error(curr_op, "urealloc failed.");
+                return -1;
+            }
+
+            // The contents up to the smaller of both sizes must have been kept
+            size_t kept = block->block_size < op.size ? block->block_size : op.size;
+            if (check_id(payload, kept, block->content_val) == -1) {
+                malloc_error(curr_op, "urealloc did not preserve the block contents.");
+                return -1;
+            }
+
+            curr_bytes_in_use += op.size - block->block_size;
+            block->is_allocated = true;
+            block->payload = payload;
+            block->block_size = op.size;
+            block->content_val = curr_op;
+            if (check_payload(block, ALIGNMENT, curr_op, "urealloc") == -1) {
+                return -1;
+            }
+
+            copy_id((size_t*) block->payload, block->block_size, curr_op);
+        }
     } else {
         trace->blocks[op.index].is_allocated = false;
 
@@ -192,10 +294,136 @@ static int auto_run_trace(trace_t *trace, int utilization, int run_check_heap, s
 
     if (utilization) {
         printf("Final Utilization percentage: %.2f\n", UTILIZATION_SCORE);
+        size_t resident = resident_bytes();
+        utrim(0);
+        printf("Final Footprint: %lu bytes held, %lu resident, %lu resident after utrim, %lu held at peak\n",
+               held_bytes, resident, resident_bytes(), peak_held_bytes);
+        uheap_stats_t stats;
+        ustats(&stats);
+        printf("Heap Growth: %s policy, %lu extends, %lu regions, %lu bytes trimmed\n",
+               stats.growth_policy, stats.extend_count, stats.region_count, stats.trimmed_bytes);
+        printf("Placement: %s policy\n", stats.placement);
+    }
+
+    if (check_huge_requests() == -1) {
+        printf("umalloc package failed.\n");
+        exit(1);
     }
     return curr_op;
 }
 
+/* Bytes in use and held by a backend over a run, at their peaks */
+typedef struct {
+    size_t max_in_use;
+    size_t peak_footprint; /* footprint grown since the backend was readied */
+} backend_usage_t;
+
+/* 
+ * run_trace_backend - Runs the trace to completion with the backend, checking
+ * that every payload keeps its contents, and records its peak use. The footprint
+ * is sampled after every op. Frees the payloads left live at the end. Returns -1
+ * if the backend fails an op.
+ */
+static int run_trace_backend(trace_t *trace, const backend_t *backend, backend_usage_t *usage) {
+    memset(trace->blocks, 0, trace->num_ids * sizeof(allocated_block_t));
+    *usage = (backend_usage_t){0};
+    size_t base = backend->footprint != NULL ? backend->footprint(backend) : 0;
+    if (backend->init != NULL && backend->init() == -1) {
+        malloc_error(-3, "init failed.");
+        return -1;
+    }
+    size_t in_use = 0;
+    int ret = 0;
+    for (size_t curr_op = 0; curr_op < trace->num_ops && ret == 0; curr_op++) {
+        if (curr_op % 5 == 0) {
+            void *gap = sbrk(4096);
+            mprotect(gap, 4096, PROT_NONE);
+        }
+        traceop_t op = trace->ops[curr_op];
+        allocated_block_t *block = &trace->blocks[op.index];
+        if (op.type == ALLOC || op.type == ALIGNED) {
+            if (op.type == ALIGNED && backend->aligned_alloc == NULL) {
+                malloc_error(curr_op, "the backend has no aligned allocation.");
+                ret = -1;
+                break;
+            }
+            void *payload = op.type == ALIGNED ? backend->aligned_alloc(OP_ALIGNMENT(op), op.size) : backend->malloc(op.size);
+            if (payload == NULL) {
+                malloc_error(curr_op, "allocation failed.");
+                ret = -1;
+                break;
+            }
+            *block = (allocated_block_t){payload, op.size, curr_op, true};
+            in_use += op.size;
+        } else if (op.type == REALLOC) {
+            size_t old_size = block->is_allocated ? block->block_size : 0;
+            void *payload = backend->realloc(block->is_allocated ? block->payload : NULL, op.size);
+            if (payload == NULL && op.size == 0) {
+                // Reallocating to zero bytes frees the block
+                in_use -= old_size;
+                *block = (allocated_block_t){0};
+                continue;
+            }
+            if (payload == NULL) {
+                malloc_error(curr_op, "realloc failed.");
+                ret = -1;
+                break;
+            }
+            if (check_id(payload, old_size < op.size ? old_size : op.size, block->content_val) == -1) {
+                malloc_error(curr_op, "realloc did not preserve the block contents.");
+                ret = -1;
+            }
+            *block = (allocated_block_t){payload, op.size, curr_op, true};
+            in_use += op.size - old_size;
+        } else {
+            if (check_id(block->payload, block->block_size, block->content_val) == -1) {
+                sprintf(msg, "the backend corrupted block id %d.", op.index);
+                malloc_error(curr_op, msg);
+                ret = -1;
+            }
+            backend->free(block->payload);
+            in_use -= block->block_size;
+            *block = (allocated_block_t){0};
+            continue;
+        }
+        copy_id(block->payload, block->block_size, curr_op);
+        if (in_use > usage->max_in_use) {
+            usage->max_in_use = in_use;
+        }
+        if (backend->footprint != NULL && backend->footprint(backend) - base > usage->peak_footprint) {
+            usage->peak_footprint = backend->footprint(backend) - base;
+        }
+    }
+    for (int id = 0; id < trace->num_ids; id++) {
+        if (trace->blocks[id].is_allocated) {
+            backend->free(trace->blocks[id].payload);
+            trace->blocks[id].is_allocated = false;
+        }
+    }
+    return ret;
+}
+
+/* 
+ * compare_backends - Runs the trace with each backend in turn and prints a table
+ * of the utilization each reaches: the most bytes in use over the most bytes
+ * held at any one time. Backends that cannot tell what they hold are listed
+ * without a utilization.
+ */
+static void compare_backends(trace_t *trace, const backend_t **backends, int count) {
+    printf("%-24s %12s %16s %16s\n", "backend", "utilization", "peak in use", "peak footprint");
+    for (int i = 0; i < count; i++) {
+        backend_usage_t usage;
+        if (run_trace_backend(trace, backends[i], &usage) == -1) {
+            printf("%-24s %12s\n", backends[i]->name, "failed");
+        } else if (backends[i]->footprint == NULL || usage.peak_footprint == 0) {
+            printf("%-24s %12s %16lu %16s\n", backends[i]->name, "n/a", usage.max_in_use, "unknown");
+        } else {
+            printf("%-24s %11.2f%% %16lu %16lu\n", backends[i]->name,
+                   100.0 * usage.max_in_use / usage.peak_footprint, usage.max_in_use, usage.peak_footprint);
+        }
+    }
+}
+
 /* 
  * help - Prints the help information for the Trace Runner.
  */
@@ -300,11 +528,13 @@ int main(int argc, char **argv)
 
   char c;
   int autorun = 0, run_check_heap = 0, display_utilization = 0;
+  const backend_t *backends[BACKEND_MAX];
+  int backend_count = 0;
 
   /* 
     * Read and interpret the command line arguments 
     */
-  while ((c = getopt(argc, argv, "rvhcu")) != EOF) {
+  while ((c = getopt(argc, argv, "rvhcub:")) != EOF) {
     switch (c) {
     case 'r': /* Generate summary info for the autograder */
         autorun = 1;
@@ -321,6 +551,16 @@ int main(int argc, char **argv)
     case 'u':
         display_utilization = 1;
         break;
+    case 'b':
+        for (char *name = strtok(optarg, ","); name != NULL; name = strtok(NULL, ",")) {
+            if (backend_count == BACKEND_MAX)
+                appl_error("Too many backends.");
+            backends[backend_count] = backend_load(name);
+            if (backends[backend_count] == NULL)
+                appl_error("Failed to load a backend.");
+            backend_count++;
+        }
+        break;
     default:
         usage();
         exit(1);
@@ -352,6 +592,14 @@ int main(int argc, char **argv)
     printf("Author: %s\n", author);
 
     trace_t *trace = read_trace(file, verbose);
+    if (backend_count > 0) {
+        compare_backends(trace, backends, backend_count);
+        for (int i = 0; i < backend_count; i++) {
+            backend_unload(backends[i]);
+        }
+        free_trace(trace);
+        return 0;
+    }
     if (uinit() == -1) {
         malloc_error(-3, "uinit failed.");
         exit(1);
@@ -9,6 +9,10 @@
 
 #include "support.h"
 #include "err_handler.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+_Static_assert(sizeof(traceop_t) == 12, "binary traces hold 12 byte ops");
 
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
@@ -34,12 +38,50 @@ void malloc_error(int opnum, char *msg)
 }
 
 /*
- * read_trace - read a trace file and store it in memory
+ * map_trace - Maps the ops of the binary trace open as tracefile straight into
+ * the trace, with nothing to parse. The mapping is populated up front, so that
+ * the replays do not fault the ops in as they go. The ops are checked in one
+ * pass, since a truncated or foreign file would otherwise index past the blocks.
+ */
+static void map_trace(trace_t *trace, FILE *tracefile, char *filename)
+{
+    struct stat st;
+    if (fstat(fileno(tracefile), &st) == -1) {
+        sprintf(msg, "Could not stat %s in read_trace", filename);
+        appl_error(msg);
+    }
+    if (trace->num_ids <= 0 || trace->num_ops < 0 ||
+        (size_t)st.st_size < sizeof(trace_header_t) + (size_t)trace->num_ops * sizeof(traceop_t)) {
+        sprintf(msg, "Binary trace %s is truncated or corrupt", filename);
+        appl_error(msg);
+    }
+    trace->map_length = st.st_size;
+    trace->map = mmap(NULL, trace->map_length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fileno(tracefile), 0);
+    if (trace->map == MAP_FAILED) {
+        sprintf(msg, "Could not map %s in read_trace", filename);
+        appl_error(msg);
+    }
+    trace->ops = (traceop_t *)((trace_header_t *)trace->map + 1);
+
+    for (int op_index = 0; op_index < trace->num_ops; op_index++) {
+        traceop_t op = trace->ops[op_index];
+        if (op.type > ALIGNED || op.index < 0 || op.index >= trace->num_ids || op.size < 0 ||
+            op.align_shift >= 8 * sizeof(size_t)) {
+            sprintf(msg, "Binary trace %s has a bogus op %d", filename, op_index);
+            appl_error(msg);
+        }
+    }
+}
+
+/*
+ * read_trace - read a trace file and store it in memory. Text traces are parsed,
+ * binary ones, told apart by their magic, are mapped.
  */
 trace_t *read_trace(char *filename, int verbose)
 {
     FILE *tracefile;
     trace_t *trace;
+    trace_header_t header;
     char type[MAXLINE];
     int err;
 
@@ -47,7 +89,7 @@ trace_t *read_trace(char *filename, int verbose)
         printf("Reading tracefile: %s\n", filename);
 
     /* Allocate the trace record */
-    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
+    if ((trace = (trace_t *) calloc(1, sizeof(trace_t))) == NULL)
         appl_error("malloc 1 failed in read_trace");
 
     /* Read the trace file header */
@@ -56,6 +98,19 @@ trace_t *read_trace(char *filename, int verbose)
         appl_error(msg);
     }
 
+    if (fread(&header, sizeof(header), 1, tracefile) == 1 &&
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) == 0) {
+        trace->num_ids = header.num_ids;
+        trace->num_ops = header.num_ops;
+        map_trace(trace, tracefile, filename);
+        fclose(tracefile);
+        trace->blocks = (allocated_block_t *)calloc(trace->num_ids, sizeof(allocated_block_t));
+        if (trace->blocks == NULL)
+            appl_error("Failed to allocate block array");
+        return trace;
+    }
+    rewind(tracefile);
+
     err = fscanf(tracefile, "%d", &(trace->num_ids)); 
     if (err == EOF) {
         appl_error("fscanf failed to find num ids.");
@@ -82,6 +137,7 @@ trace_t *read_trace(char *filename, int verbose)
     unsigned op_index = 0;
     unsigned max_index = 0;
     unsigned size = 0;
+    unsigned alignment = 0;
     while (fscanf(tracefile, "%s", type) != EOF) {
         switch(type[0]) {
         case 'a':
@@ -94,6 +150,30 @@ trace_t *read_trace(char *filename, int verbose)
             trace->ops[op_index].size = size;
             max_index = (index > max_index) ? index : max_index;
             break;
+        case 'r':
+            err = fscanf(tracefile, "%u %u", &index, &size);
+            if (err == EOF) {
+                appl_error("fscanf failed to find index and size.");
+            }
+            trace->ops[op_index].type = REALLOC;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            max_index = (index > max_index) ? index : max_index;
+            break;
+        case 'm':
+            err = fscanf(tracefile, "%u %u %u", &index, &alignment, &size);
+            if (err == EOF) {
+                appl_error("fscanf failed to find index, alignment and size.");
+            }
+            if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+                appl_error("The alignment of an aligned alloc must be a power of two.");
+            }
+            trace->ops[op_index].type = ALIGNED;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].align_shift = __builtin_ctz(alignment);
+            trace->ops[op_index].size = size;
+            max_index = (index > max_index) ? index : max_index;
+            break;
         case 'f':
             err = fscanf(tracefile, "%ud", &index);
             if (err == EOF) {
@@ -116,13 +196,59 @@ trace_t *read_trace(char *filename, int verbose)
     return trace;
 }
 
+/*
+ * write_trace - Writes the trace out to filename, as a binary trace or as text.
+ */
+void write_trace(trace_t *trace, char *filename, bool binary)
+{
+    FILE *tracefile;
+    if ((tracefile = fopen(filename, "w")) == NULL) {
+        sprintf(msg, "Could not open %s in write_trace", filename);
+        appl_error(msg);
+    }
+
+    if (binary) {
+        trace_header_t header = {.num_ids = trace->num_ids, .num_ops = trace->num_ops};
+        memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+        fwrite(&header, sizeof(header), 1, tracefile);
+        fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, tracefile);
+    } else {
+        fprintf(tracefile, "%d\n%d\n", trace->num_ids, trace->num_ops);
+        for (int op_index = 0; op_index < trace->num_ops; op_index++) {
+            traceop_t op = trace->ops[op_index];
+            switch(op.type) {
+            case ALLOC:
+                fprintf(tracefile, "a %d %d\n", op.index, op.size);
+                break;
+            case REALLOC:
+                fprintf(tracefile, "r %d %d\n", op.index, op.size);
+                break;
+            case ALIGNED:
+                fprintf(tracefile, "m %d %lu %d\n", op.index, OP_ALIGNMENT(op), op.size);
+                break;
+            default:
+                fprintf(tracefile, "f %d\n", op.index);
+            }
+        }
+    }
+
+    if (ferror(tracefile) || fclose(tracefile) != 0) {
+        sprintf(msg, "Failed to write %s in write_trace", filename);
+        appl_error(msg);
+    }
+}
+
 /*
  * free_trace - Free the trace record and the two arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated in read_trace(). The ops
+ *              of a binary trace are unmapped instead.
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the two arrays... */
+    if (trace->map != NULL)   /* free the two arrays... */
+        munmap(trace->map, trace->map_length);
+    else
+        free(trace->ops);
     free(trace->blocks);      
     free(trace);              /* and the trace record itself... */
 }
\ No newline at end of file
@@ -31,22 +31,46 @@ typedef struct {
 } allocated_block_t;
 
 
-/* Characterizes a single trace operation (allocator request) */
+/* The types of trace operations */
+enum {ALLOC, FREE, REALLOC, ALIGNED};
+
+/* 
+ * Characterizes a single trace operation (allocator request). Packed to 12 bytes,
+ * it is also the layout of an op in a binary trace file.
+ */
 typedef struct {
-    enum {ALLOC, FREE} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc request */
+    uint8_t type;                     /* type of request */
+    uint8_t align_shift;              /* log2 of the payload alignment of an aligned alloc request */
+    uint16_t unused;
+    int32_t index;                    /* index for free() to use later */
+    int32_t size;                     /* byte size of alloc or realloc request */
 } traceop_t;
 
+#define OP_ALIGNMENT(op) ((size_t)1 << (op).align_shift) /* payload alignment of an aligned alloc */
+
+/* 
+ * The header of a binary trace file, followed by num_ops traceop_t records in
+ * the byte order of the machine that wrote it.
+ */
+#define TRACE_MAGIC "MMTRACE1"
+typedef struct {
+    char magic[8];
+    int32_t num_ids;
+    int32_t num_ops;
+} trace_header_t;
+
 /* Holds the information for one trace file*/
 typedef struct {
     int num_ids;         /* number of alloc ids */
     int num_ops;         /* number of distinct requests */
     traceop_t *ops;      /* array of requests */
     allocated_block_t *blocks; /* array of blocks returned by umalloc */
+    void *map;           /* the mapped file of a binary trace, NULL for a text trace */
+    size_t map_length;
 } trace_t;
 
 void appl_error(char *msg);
 void malloc_error(int opnum, char *msg);
 trace_t *read_trace(char *filename, int verbose);
+void write_trace(trace_t *trace, char *filename, bool binary);
 void free_trace(trace_t *trace);
\ No newline at end of file
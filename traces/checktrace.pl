@@ -77,6 +77,11 @@ while ($line = <STDIN>) {
     # save the line for output later
     $lines[$requestnum++] = $line;
 
+    # an aligned allocate is checked like a plain one
+    if ($cmd eq "m") {
+	$cmd = "a";
+    }
+
     if ($cmd eq "a" and $HASH{$id} eq "a") {
 	die "$0: ERROR[$linenum]: allocate with no intervening free.\n";
     }
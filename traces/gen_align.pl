@@ -0,0 +1,53 @@
+#!/usr/bin/perl
+#!/usr/local/bin/perl
+
+$out_filename = "align.rep";
+$num_ops = 6000;
+$num_slots = 200;
+$aligned_percent = 60;
+$large_percent = 2;
+$max_size = 2048;
+$max_large_size = 262144;
+@alignments = (32, 64, 64, 128, 256, 4096);
+
+srand(429);
+
+# Random slots are allocated or freed, mixing plain allocations with aligned
+# ones of cache line to page alignment, and a few large aligned buffers
+$seq = 0;
+@slots = ();
+for ($i = 0;  $i < $num_ops; $i += 1) {
+    $slot = int(rand($num_slots));
+    if (defined $slots[$slot]) {
+        push @trace, "f $slots[$slot]";
+        undef $slots[$slot];
+        next;
+    }
+    if (int(rand(100)) < $large_percent) {
+        $size = 65536 + int(rand($max_large_size - 65536));
+    } else {
+        $size = 1 + int(rand($max_size));
+    }
+    if (int(rand(100)) < $aligned_percent) {
+        $alignment = $alignments[int(rand(scalar @alignments))];
+        push @trace, "m $seq $alignment $size";
+    } else {
+        push @trace, "a $seq $size";
+    }
+    $slots[$slot] = $seq;
+    $seq += 1;
+}
+
+# Open output file
+open OUTFILE, ">$out_filename" or die "Cannot create $out_filename\n";
+
+$num_ops = scalar @trace;
+
+print OUTFILE "$seq\n";
+print OUTFILE "$num_ops\n";
+
+foreach $op (@trace) {
+    print OUTFILE "$op\n";
+}
+
+close OUTFILE;
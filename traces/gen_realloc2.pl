@@ -0,0 +1,31 @@
+#!/usr/bin/perl
+#!/usr/local/bin/perl
+
+$out_filename = "realloc2.rep";
+$init_size = 4092;
+$blk_size = 16;
+$grow_size = 5;
+$num_iters = 4800;
+
+# Open output file
+open OUTFILE, ">$out_filename" or die "Cannot create $out_filename\n";
+
+# Calculate misc parameters
+$num_blocks = $num_iters + 2;
+$num_ops = 3*$num_iters + 2;
+
+print OUTFILE "$num_blocks\n";
+print OUTFILE "$num_ops\n";
+
+# Grow one block by odd amounts, while a tiny block is allocated after each step
+print OUTFILE "a 0 $init_size\n";
+print OUTFILE "a 1 $blk_size\n";
+for ($i = 1;  $i <= $num_iters; $i += 1) {
+    $size = $init_size + $grow_size*$i;
+    $aseq = $i + 1;
+    print OUTFILE "r 0 $size\n";
+    print OUTFILE "a $aseq $blk_size\n";
+    print OUTFILE "f $i\n";
+}
+
+close OUTFILE;
@@ -0,0 +1,48 @@
+#!/usr/bin/perl
+#!/usr/local/bin/perl
+
+$out_filename = "request.rep";
+$num_requests = 500;
+$min_objects = 8;
+$max_objects = 48;
+$max_small_size = 256;
+$max_large_size = 8192;
+$large_percent = 5;
+
+srand(429);
+
+# Every request allocates a batch of objects, mostly small ones, and frees all
+# of them in random order before the next request starts
+$seq = 0;
+for ($r = 0;  $r < $num_requests; $r += 1) {
+    $count = $min_objects + int(rand($max_objects - $min_objects + 1));
+    @live = ();
+    for ($i = 0;  $i < $count; $i += 1) {
+        if (int(rand(100)) < $large_percent) {
+            $size = $max_small_size + int(rand($max_large_size - $max_small_size));
+        } else {
+            $size = 1 + int(rand($max_small_size));
+        }
+        push @trace, "a $seq $size";
+        push @live, $seq;
+        $seq += 1;
+    }
+    while (@live) {
+        $victim = splice @live, int(rand(scalar @live)), 1;
+        push @trace, "f $victim";
+    }
+}
+
+# Open output file
+open OUTFILE, ">$out_filename" or die "Cannot create $out_filename\n";
+
+$num_ops = scalar @trace;
+
+print OUTFILE "$seq\n";
+print OUTFILE "$num_ops\n";
+
+foreach $op (@trace) {
+    print OUTFILE "$op\n";
+}
+
+close OUTFILE;
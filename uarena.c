@@ -0,0 +1,138 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * uarena.c - Arenas on top of the umalloc heaps. An arena carves objects out of
+ * its first chunk by bumping a pointer, and takes a new chunk from its heap when
+ * the first one runs out. Objects larger than a quarter of a chunk get a chunk of
+ * their own behind the first one, so they never waste the rest of it. Nothing is
+ * freed until uarena_reset or uarena_destroy, which cost one ufree per chunk.
+ **************************************************************************/
+
+#include "umalloc.h"
+#include "uarena.h"
+
+/*
+ * uarena_create - creates an empty arena. options may be NULL to use the defaults.
+ * Returns NULL if an error occurred.
+ */
+uarena_t *uarena_create(const uarena_options_t *options)
+{
+    uheap_t *heap = options != NULL && options->heap != NULL ? options->heap : uheap_default();
+    uarena_t *arena = uheap_malloc(heap, sizeof(uarena_t));
+    if (arena == NULL)
+    {
+        return NULL;
+    }
+    *arena = (uarena_t){0};
+    arena->heap = heap;
+    arena->chunk_size = UARENA_CHUNK_SIZE;
+    if (options != NULL)
+    {
+        arena->chunk_size = options->chunk_size != 0 ? ALIGN(options->chunk_size) : arena->chunk_size;
+        arena->keep_chunks = options->keep_chunks;
+    }
+    return arena;
+}
+
+/*
+ * chunk_alloc - returns a chunk of size bytes, from the spare chunks when size is
+ * the chunk size of the arena and one is left. Returns NULL if an error occurred.
+ */
+static uarena_chunk_t *chunk_alloc(uarena_t *arena, size_t size)
+{
+    uarena_chunk_t *chunk = arena->spare;
+    if (size == arena->chunk_size && chunk != NULL)
+    {
+        arena->spare = chunk->next;
+        return chunk;
+    }
+    chunk = uheap_malloc(arena->heap, ALIGN(sizeof(uarena_chunk_t)) + size);
+    if (chunk != NULL)
+    {
+        chunk->size = size;
+    }
+    return chunk;
+}
+
+/*
+ * uarena_alloc - allocates size bytes from the arena and returns a pointer to the
+ * allocated memory, which stays valid until the arena is reset or destroyed.
+ * Returns NULL if an error occurred.
+ */
+void *uarena_alloc(uarena_t *arena, size_t size)
+{
+    size = ALIGN(size);
+    if (size <= (size_t)(arena->end - arena->next))
+    {
+        void *object = arena->next;
+        arena->next += size;
+        return object;
+    }
+
+    bool own_chunk = size > arena->chunk_size / 4;
+    uarena_chunk_t *chunk = chunk_alloc(arena, own_chunk ? size : arena->chunk_size);
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+    char *start = (char *)chunk + ALIGN(sizeof(uarena_chunk_t));
+    if (own_chunk && arena->chunks != NULL)
+    {
+        // Keep carving the first chunk, whose space is still good for small objects
+        chunk->next = arena->chunks->next;
+        arena->chunks->next = chunk;
+        return start;
+    }
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->next = start + size;
+    arena->end = start + chunk->size;
+    return start;
+}
+
+/*
+ * uarena_reset - frees every object of the arena at once. Chunks of the arena's
+ * chunk size are kept for reuse if the arena was created with keep_chunks.
+ */
+void uarena_reset(uarena_t *arena)
+{
+    uarena_chunk_t *chunk = arena->chunks;
+    while (chunk != NULL)
+    {
+        uarena_chunk_t *next = chunk->next;
+        if (arena->keep_chunks && chunk->size == arena->chunk_size)
+        {
+            chunk->next = arena->spare;
+            arena->spare = chunk;
+        }
+        else
+        {
+            uheap_free(arena->heap, chunk);
+        }
+        chunk = next;
+    }
+    arena->chunks = NULL;
+    arena->next = NULL;
+    arena->end = NULL;
+}
+
+/*
+ * uarena_destroy - frees every object of the arena and the arena itself.
+ */
+void uarena_destroy(uarena_t *arena)
+{
+    if (arena == NULL)
+    {
+        return;
+    }
+    arena->keep_chunks = false;
+    uarena_reset(arena);
+    uarena_chunk_t *chunk = arena->spare;
+    while (chunk != NULL)
+    {
+        uarena_chunk_t *next = chunk->next;
+        uheap_free(arena->heap, chunk);
+        chunk = next;
+    }
+    uheap_free(arena->heap, arena);
+}
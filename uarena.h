@@ -0,0 +1,58 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * uarena.h - Arenas for allocations that all die at once, such as those made
+ * while serving one request. Objects are bump allocated from chunks taken from
+ * a umalloc heap, are never freed one by one, and go away together when the
+ * arena is reset or destroyed.
+ **************************************************************************/
+
+#ifndef UARENA_H
+#define UARENA_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "csbrk.h"
+
+#define UARENA_CHUNK_SIZE (8 * PAGESIZE) /* default bytes of objects per chunk */
+
+/*
+ * uarena_chunk_t - The header in front of every chunk of an arena.
+ */
+typedef struct uarena_chunk
+{
+    struct uarena_chunk *next;
+    size_t size; /* bytes after the header */
+} uarena_chunk_t;
+
+/*
+ * uarena_options_t - Settings of an arena, given to uarena_create. Zeroed fields
+ * take their default values.
+ */
+typedef struct uarena_options
+{
+    struct uheap_struct *heap; /* heap the chunks come from, NULL for the default heap */
+    size_t chunk_size;         /* bytes of objects per chunk */
+    bool keep_chunks;          /* keep chunks across resets instead of freeing them */
+} uarena_options_t;
+
+/*
+ * uarena_t - An arena. Not thread safe: each thread should use arenas of its own.
+ */
+typedef struct uarena
+{
+    struct uheap_struct *heap;
+    uarena_chunk_t *chunks; /* chunks in use, the one being carved first */
+    uarena_chunk_t *spare;  /* chunks kept by uarena_reset for reuse */
+    char *next;             /* next free byte of the first chunk */
+    char *end;              /* end of the first chunk */
+    size_t chunk_size;
+    bool keep_chunks;
+} uarena_t;
+
+uarena_t *uarena_create(const uarena_options_t *options);
+void *uarena_alloc(uarena_t *arena, size_t size);
+void uarena_reset(uarena_t *arena);
+void uarena_destroy(uarena_t *arena);
+
+#endif
@@ -3,91 +3,206 @@
 #include "ansicolors.h"
 #include <stdio.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef UMALLOC_THREADS
+#define LOCK_HEAP(heap) pthread_mutex_lock(&(heap)->lock)
+#define UNLOCK_HEAP(heap) pthread_mutex_unlock(&(heap)->lock)
+#define LOCK_OS() pthread_mutex_lock(&os_lock)
+#define UNLOCK_OS() pthread_mutex_unlock(&os_lock)
+#else
+#define LOCK_HEAP(heap)
+#define UNLOCK_HEAP(heap)
+#define LOCK_OS()
+#define UNLOCK_OS()
+#endif
 
 /*
- * For this memory allocator, free blocks are structured with a header and a footer.
- * The header contains the size of the block, its allocation status, pointers to the
- * next and previous free blocks, and a field for a magic number used to validate 
- * each block. The header appears at the start of the free block, while the footer
- * appears at the end after the data.
+ * For this memory allocator, every block starts with an 8 byte header holding the
+ * size of the whole block, its allocation status, and whether the block directly
+ * below it is free. Free blocks keep pointers to the next and previous free blocks
+ * of their bin right after the header, and end with a footer repeating their size.
+ * 
+ * Allocated blocks only carry the header; the list pointers and footer space are
+ * part of the payload. Since a footer exists only below a header whose prev free
+ * bit is set, coalescing stays constant time. Each region starts with its
+ * sbrk_block and ends with an allocated epilogue header of size 0, so merging
+ * never runs past either end of a region.
+ * 
+ * Free blocks are kept in a two-level segregated fit (TLSF) structure. The first
+ * level splits sizes into power of two classes, and the second level splits each
+ * class into SL_INDEX_COUNT linearly spaced bins. Every bin is a circular doubly-linked
+ * list, and a bitmap per level records which bins are non-empty, so insert, remove
+ * and lookup are all constant time.
+ * 
+ * The top free block of the region grown last is the wilderness, kept out of the
+ * bins and the tree. It serves only requests no other free block fits, by moving
+ * its start up past the new block, so the ramp-up of a heap costs a header and
+ * footer write per allocation.
  * 
- * Allocated blocks use the same structure as free blocks, but they are marked as 
- * allocated and have both their previous and next pointers NULLed out.
+ * Free blocks of at least TREE_MIN_SIZE bytes, whose sizes vary too widely for the
+ * bins to tell apart, are kept in a red-black tree instead, ordered by size and
+ * then address. The tree node overlays the payload like the list links do, and
+ * gives an exact best fit in logarithmic time once no bin has a block that fits.
  * 
- * The free list is organized in non-decreasing order of size in a doubly-linked list.
- * Blocks at the start of the list must be smaller or equal in size to blocks at the 
- * end.
+ * Requests of at most SLAB_MAX_SIZE bytes bypass the blocks entirely. They are
+ * served from slab runs: single pages taken from csbrk, each split into equally
+ * sized objects of one size class with no per object header. A bitmap in the run
+ * header tracks the free objects, and ufree finds the run through the page map,
+ * so small allocations and frees are constant time and never coalesce.
  * 
- * Each time umalloc is called, the free list is searched for a block of best fit, or 
- * one of smallest size that is big enough for the query. If there is not a large 
- * enough block available, the heap is extended to make room. The found block is then
+ * Each time umalloc is called for a larger request, the request is rounded up to
+ * the next bin boundary and the bitmaps are searched with find-first-set for the
+ * first non-empty bin whose blocks are all big enough (good fit). If there is not a large enough block
+ * available, the heap is extended to make room. The found block is then
  * split into an allocated block in the lower addresses and a free block in the upper
  * addresses. The allocated block is of the minimum size needed to satisfy the request,
  * while the free block is all the leftover space. The free block is added to the free
  * list while the payload of the allocated block is returned to the user. All returned
  * pointers are 16-bit aligned.
  * 
- * Each time ufree is called, the validity of the given pointer is checked. If it is
- * a valid block, it is marked as unallocated, coalesced with neighboring free blocks,
- * and added to the free list.
+ * Each time ufree is called, the validity of the given pointer is checked against the
+ * page map and the allocated bit. If it is a valid block, it is marked as unallocated,
+ * coalesced with neighboring free blocks, and added to the free list.
+ * 
+ * Blocks of at most QUICK_MAX_SIZE bytes skip that on their way out: they are pushed
+ * on a quick list for their exact size, still marked allocated with the quick bit
+ * set, and handed straight back to the next request of that size. Coalescing is
+ * deferred until the quick lists hold more than the quick threshold, no free block
+ * fits a request, or utrim runs.
+ * 
+ * ualigned_alloc looks for a free block with room for the request plus the
+ * alignment, and splits it in three: the fragment below the aligned payload and
+ * the tail above the new block go back to the free lists. Large aligned requests
+ * get a mapping with the payload placed at an aligned offset instead. Either way
+ * ufree needs nothing to tell aligned blocks apart.
+ * 
+ * ucalloc clears only memory that has been used before. The heap keeps a fresh
+ * mark in the wilderness region, above which the memory has not been touched
+ * since the kernel zeroed it; blocks bumped off the wilderness above the mark and
+ * new mappings are returned as they are, so their pages are not touched at all.
+ * 
+ * urealloc resizes blocks in place whenever it can: a shrinking block splits off its
+ * tail, and a growing block absorbs the free block above it, extending its region
+ * at the program break when it sits at the top. Data is only copied otherwise.
+ * 
+ * Requests of at least MMAP_THRESHOLD bytes get a mapping of their own, with an
+ * mmap_region_t header in front of the payload, which ufree unmaps directly. A few
+ * freed mappings are cached, and urealloc resizes mappings with mremap, so large
+ * buffers never fragment the heap.
+ * 
+ * Free memory goes back to the OS once a free block grows past the trim threshold:
+ * the program break is lowered when the block sits at the top of the region at
+ * the break, and the pages inside the block are released otherwise. utrim does
+ * the same for every free block on demand.
+ * 
+ * How much the heap grows when no free block fits is up to its growth policy:
+ * fixed chunks, twice the heap size, or (by default) room for the recent request
+ * sizes plus extra while most of the heap is in use. The UMALLOC_GROWTH
+ * environment variable picks the policy for the default heap, and ustats reports
+ * it with the number of extends and regions.
+ * 
+ * In the same way UMALLOC_PLACEMENT swaps the TLSF good fit described above for
+ * address-ordered first fit, next fit, exact best fit, a good fit bounded to a few
+ * candidates, or small blocks split off the high end of their free block, so
+ * placement can be compared per trace without rebuilding.
+ * 
+ * All of the above state belongs to a uheap_t, so several independent heaps can be
+ * used at once through uheap_create. Only csbrk, the page map and the memory of
+ * destroyed heaps are shared between heaps. umalloc and ufree use the default heap.
  */
 
 const char author[] = ANSI_BOLD ANSI_COLOR_RED "Isaac Adams EID: iga263" ANSI_RESET;
 
-const int MAGIC_NUMBER = 0x12345678;
+const int HEADER_SIZE = sizeof(size_t);
+
+/*
+ * The page map is a radix tree from page numbers to the regions covering them.
+ * The root is static, while the mid and leaf nodes are mapped as they are needed.
+ */
+typedef struct pagemap_leaf
+{
+    sbrk_block *entries[1 << PAGEMAP_LEAF_BITS];
+} pagemap_leaf_t;
+
+typedef struct pagemap_mid
+{
+    pagemap_leaf_t *leaves[1 << PAGEMAP_MID_BITS];
+} pagemap_mid_t;
+
+pagemap_mid_t *pagemap_root[1 << PAGEMAP_ROOT_BITS];
+
+/*
+ * Memory of destroyed heaps is kept as spare chunks, sorted by address and merged
+ * with their neighbors, and handed to new regions before csbrk is called again.
+ */
+typedef struct spare_chunk
+{
+    size_t size;
+    struct spare_chunk *next;
+} spare_chunk_t;
+
+#define SPARE_MIN_SIZE 64
+
+static spare_chunk_t *spare_chunks;
 
-const int HEADER_SIZE = sizeof(memory_block_t) + sizeof(footer_t);
+// Freed mappings of large requests kept for reuse by any heap.
+static mmap_region_t *mmap_cache[MMAP_CACHE_SLOTS];
 
-sbrk_block *block_head;
+// The heap used by umalloc and ufree, set up by uinit.
+static uheap_t default_heap;
 
-int heap_size = 0;
+#ifdef UMALLOC_THREADS
+// Serializes csbrk, page map updates and the spare chunks, which all heaps share.
+static pthread_mutex_t os_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 /*
  * The following helpers can be used to interact with the memory_block_t
  * struct, they can be adjusted as necessary.
  */
 
-// A sample pointer to the start of the free list.
-memory_block_t *free_head;
-
 /*
  * is_allocated - Given a header, returns true if a block is marked as allocated.
  */
 bool is_allocated(memory_block_t *block)
 {
     assert(block != NULL);
-    return block->block_size_alloc & 0x1;
+    return block->block_size_alloc & ALLOC_BIT;
 }
 
 /*
- * is_allocated_footer - Given a footer, returns true if a block is marked as allocated.
+ * is_prev_free - Given a header, returns true if the block directly below is free,
+ * meaning its footer sits just before this header.
  */
-bool is_allocated_footer(footer_t *block)
+bool is_prev_free(memory_block_t *block)
 {
     assert(block != NULL);
-    return block->block_size_alloc & 0x1;
+    return block->block_size_alloc & PREV_FREE_BIT;
 }
 
 /*
- * allocate - marks a block as allocated. Modified to also mark the footer
+ * allocate - marks a block as allocated. Modified to also tell the block above
+ * that its lower neighbor no longer has a footer.
  */
 void allocate(memory_block_t *block)
 {
     assert(block != NULL);
-    block->block_size_alloc |= 0x1;
-    footer_t *footer = get_footer(block);
-    footer->block_size_alloc = block->block_size_alloc;
+    block->block_size_alloc |= ALLOC_BIT;
+    get_above_header(block)->block_size_alloc &= ~PREV_FREE_BIT;
 }
 
 /*
- * deallocate - marks a block as unallocated. Modified to also mark the footer.
+ * deallocate - marks a block as unallocated. Modified to also write the footer
+ * and mark the block above as having a free lower neighbor.
  */
 void deallocate(memory_block_t *block)
 {
     assert(block != NULL);
-    block->block_size_alloc &= ~0x1;
-    footer_t *footer = get_footer(block);
-    footer->block_size_alloc = block->block_size_alloc;
+    block->block_size_alloc &= ~ALLOC_BIT;
+    get_footer(block)->block_size_alloc = get_size(block);
+    get_above_header(block)->block_size_alloc |= PREV_FREE_BIT;
 }
 
 /*
@@ -119,24 +234,29 @@ memory_block_t *get_next(memory_block_t *block)
 
 /*
  * put_block - puts a block struct into memory at the specified address.
- * Initializes the size, allocated, and magic number fields, along with NUlling out the next 
- * field. Modified to also place the footer in the appropriate memory location.
+ * Initializes the size and allocated fields with the prev free bit cleared, along
+ * with NUlling out the list links of a free block. Free blocks also get a footer,
+ * and the prev free bit of the block above is updated to match.
  */
 void put_block(memory_block_t *block, size_t size, bool alloc)
 {
     assert(block != NULL);
     assert(size % ALIGNMENT == 0);
     assert(alloc >> 1 == 0);
-    // put heaer
+    // put header
     block->block_size_alloc = size | alloc;
-    block->magic_number = MAGIC_NUMBER;
+    memory_block_t *above = get_above_header(block);
+    if (alloc)
+    {
+        above->block_size_alloc &= ~PREV_FREE_BIT;
+        return;
+    }
     block->prev = NULL;
     block->next = NULL;
 
     // put footer
-    footer_t *footer = get_footer(block);
-    footer->block_size_alloc = block->block_size_alloc;
-    footer->magic_number = MAGIC_NUMBER;
+    get_footer(block)->block_size_alloc = size;
+    above->block_size_alloc |= PREV_FREE_BIT;
 }
 
 /*
@@ -145,7 +265,7 @@ void put_block(memory_block_t *block, size_t size, bool alloc)
 void *get_payload(memory_block_t *block)
 {
     assert(block != NULL);
-    return (void *)(block + 1);
+    return ((void *)block) + HEADER_SIZE;
 }
 
 /*
@@ -154,7 +274,7 @@ void *get_payload(memory_block_t *block)
 memory_block_t *get_block(void *payload)
 {
     assert(payload != NULL);
-    return ((memory_block_t *)payload) - 1;
+    return (memory_block_t *)(payload - HEADER_SIZE);
 }
 
 /*
@@ -163,7 +283,7 @@ memory_block_t *get_block(void *payload)
 footer_t *get_footer(memory_block_t *block)
 {
     assert(block != NULL);
-    return ((void *)(block + 1)) + get_size(block);
+    return ((footer_t *)get_above_header(block)) - 1;
 }
 
 /*
@@ -172,8 +292,7 @@ footer_t *get_footer(memory_block_t *block)
 memory_block_t *get_header(footer_t *footer)
 {
     assert(footer != NULL);
-    void *temp = ((void *)footer) - get_size_footer(footer);
-    return ((memory_block_t *)temp) - 1;
+    return (memory_block_t *)(((void *)(footer + 1)) - get_size_footer(footer));
 }
 
 /*
@@ -182,375 +301,2720 @@ memory_block_t *get_header(footer_t *footer)
  */
 
 /*
- * insert - inserts the given free block into the free list in order of increasing size.
+ * fls - returns the index of the most significant set bit of a non-zero word.
  */
-void insert(memory_block_t *block)
+static inline int fls(size_t word)
 {
-    // Check if list is empty
-    if (free_head == NULL)
-    {
-        // Insert block as only element
-        free_head = block;
-        free_head->next = free_head;
-        free_head->prev = free_head;
-    }
-    else if (get_size(block) <= get_size(free_head))
+    assert(word != 0);
+    return (sizeof(size_t) * 8 - 1) - __builtin_clzl(word);
+}
+
+/*
+ * ffs - returns the index of the least significant set bit of a non-zero word.
+ */
+static inline int ffs(unsigned int word)
+{
+    assert(word != 0);
+    return __builtin_ctz(word);
+}
+
+/*
+ * mapping_insert - computes the first and second level indices of the bin that a
+ * free block of the given size belongs in.
+ */
+void mapping_insert(size_t size, int *fl, int *sl)
+{
+    if (size < SMALL_BLOCK_SIZE)
     {
-        // Insert block at start
-        block->next = free_head;
-        block->prev = free_head->prev;
-        free_head->prev->next = block;
-        free_head->prev = block;
-        free_head = block;
+        // Small blocks are stored in linearly spaced bins of the first level
+        *fl = 0;
+        *sl = size / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
     }
     else
     {
-        // Search through free list for proper position
-        memory_block_t *previous = free_head;
-        memory_block_t *current = get_next(free_head);
-        while (current != free_head && get_size(block) > get_size(current))
-        {
-            previous = current;
-            current = get_next(current);
-        }
-        // Insert block at found position
-        block->next = current;
-        block->prev = previous;
-        previous->next = block;
-        current->prev = block;
+        int msb = fls(size);
+        *sl = (size >> (msb - SL_INDEX_COUNT_LOG2)) ^ (1 << SL_INDEX_COUNT_LOG2);
+        *fl = msb - (FL_INDEX_SHIFT - 1);
     }
 }
 
 /*
- * insert_at_end - inserts given free block at the end of the free list
+ * mapping_search - computes the indices of the first bin whose blocks are all
+ * large enough to satisfy a request of the given size.
  */
-void insert_at_end(memory_block_t *block)
+void mapping_search(size_t size, int *fl, int *sl)
 {
-    // Check if list is empty
-    if (free_head == NULL)
-    {
-        // Insert as only element
-        block->next = block;
-        block->prev = block;
-        free_head = block;
-    }
-    else
+    if (size >= SMALL_BLOCK_SIZE)
     {
-        // Insert as last element
-        block->next = free_head;
-        block->prev = free_head->prev;
-        free_head->prev->next = block;
-        free_head->prev = block;
+        // Round up to the next second level boundary
+        size += (1UL << (fls(size) - SL_INDEX_COUNT_LOG2)) - 1;
     }
+    mapping_insert(size, fl, sl);
 }
 
 /*
- * print_list - Prints out the addresses of each element of the list in order
+ * tree_less - returns true if node a comes before node b, ordering by size first
+ * and by address among equal sizes.
  */
-void print_list()
+static inline bool tree_less(tree_block_t *a, tree_block_t *b)
 {
-    memory_block_t *temp = free_head;
-    do
-    {
-        printf("Address: %p, ", temp);
-        temp = temp->next;
-    } while (temp != free_head);
-    printf("\n");
+    size_t size_a = get_size((memory_block_t *)a);
+    size_t size_b = get_size((memory_block_t *)b);
+    return size_a < size_b || (size_a == size_b && a < b);
 }
 
 /*
- * remove_from_list - removes the given block from the free list if it is present
+ * tree_rotate - rotates node down to the left, or to the right if left is false,
+ * moving its child on the other side up in its place.
  */
-void remove_from_list(memory_block_t *block)
+static void tree_rotate(uheap_t *heap, tree_block_t *node, bool left)
 {
-    // Check that the block is still in the list
-    if (block->next != NULL && block->prev != NULL)
+    tree_block_t *nil = &heap->tree_nil;
+    tree_block_t *child = left ? node->right : node->left;
+    if (left)
     {
-        if (block->next == block)
+        node->right = child->left;
+        if (child->left != nil)
         {
-            // block is the only element in the free list
-            free_head = NULL;
-            block->prev = NULL;
-            block->next = NULL;
+            child->left->parent = node;
         }
-        else
+        child->left = node;
+    }
+    else
+    {
+        node->left = child->right;
+        if (child->right != nil)
         {
-            block->prev->next = block->next;
-            block->next->prev = block->prev;
-
-            if (free_head == block)
-            {
-                // Update free_head
-                free_head = block->next;
-            }
-            block->prev = NULL;
-            block->next = NULL;
+            child->right->parent = node;
         }
+        child->right = node;
+    }
+    child->parent = node->parent;
+    if (node->parent == nil)
+    {
+        heap->free_tree = child;
+    }
+    else if (node == node->parent->left)
+    {
+        node->parent->left = child;
+    }
+    else
+    {
+        node->parent->right = child;
     }
+    node->parent = child;
 }
 
 /*
- * get_above_header - returns a pointer to the header of the block above the given block
+ * tree_insert - adds a free block to the tree and restores the red-black
+ * properties on the way back up.
  */
-memory_block_t *get_above_header(memory_block_t *block)
+static void tree_insert(uheap_t *heap, tree_block_t *node)
 {
-    return (memory_block_t *)(get_footer(block) + 1);
+    tree_block_t *nil = &heap->tree_nil;
+    tree_block_t *parent = nil;
+    tree_block_t **link = &heap->free_tree;
+    while (*link != nil)
+    {
+        parent = *link;
+        link = tree_less(node, parent) ? &parent->left : &parent->right;
+    }
+    *link = node;
+    node->parent = parent;
+    node->left = nil;
+    node->right = nil;
+    node->red = true;
+
+    // A red node with a red parent is fixed by recoloring while the uncle is red,
+    // and by at most two rotations once it is black
+    while (node->parent->red)
+    {
+        parent = node->parent;
+        tree_block_t *grandparent = parent->parent;
+        bool parent_left = parent == grandparent->left;
+        tree_block_t *uncle = parent_left ? grandparent->right : grandparent->left;
+        if (uncle->red)
+        {
+            parent->red = false;
+            uncle->red = false;
+            grandparent->red = true;
+            node = grandparent;
+            continue;
+        }
+        if (node == (parent_left ? parent->right : parent->left))
+        {
+            node = parent;
+            tree_rotate(heap, node, parent_left);
+            parent = node->parent;
+        }
+        parent->red = false;
+        grandparent->red = true;
+        tree_rotate(heap, grandparent, !parent_left);
+    }
+    heap->free_tree->red = false;
 }
 
 /*
- * get_below_footer - returns a pointer to the footer of the block below the given block
+ * tree_transplant - puts replacement in the place of node in the tree.
  */
-footer_t *get_below_footer(memory_block_t *block)
+static void tree_transplant(uheap_t *heap, tree_block_t *node, tree_block_t *replacement)
 {
-    return ((footer_t *)block) - 1;
+    if (node->parent == &heap->tree_nil)
+    {
+        heap->free_tree = replacement;
+    }
+    else if (node == node->parent->left)
+    {
+        node->parent->left = replacement;
+    }
+    else
+    {
+        node->parent->right = replacement;
+    }
+    replacement->parent = node->parent;
 }
 
 /*
- * find - finds a free block that can satisfy the umalloc request. Free block found with best fit.
- * Free list should be sorted in increasing size. Extends the heap if not enough space is available.
+ * tree_remove - takes a free block out of the tree and restores the red-black
+ * properties, leaving the links of the block cleared.
  */
-memory_block_t *find(size_t size)
+static void tree_remove(uheap_t *heap, tree_block_t *node)
 {
-
-    // Check if free list is empty
-    if (free_head == NULL)
+    tree_block_t *nil = &heap->tree_nil;
+    tree_block_t *moved = node; /* the node leaving its position */
+    bool moved_red = moved->red;
+    tree_block_t *child;        /* the node taking the place of moved */
+    if (node->left == nil)
     {
-        return extend(size);
+        child = node->right;
+        tree_transplant(heap, node, child);
     }
-
-    // Handle comparison with free_head
-    if (get_size(free_head) >= size)
+    else if (node->right == nil)
     {
-        return free_head;
+        child = node->left;
+        tree_transplant(heap, node, child);
     }
-
-    // Compare size to the size of each free block
-    memory_block_t *current = get_next(free_head);
-    while (current != free_head && get_size(current) < size)
+    else
     {
-        current = get_next(current);
+        // Replace the node with its successor
+        moved = node->right;
+        while (moved->left != nil)
+        {
+            moved = moved->left;
+        }
+        moved_red = moved->red;
+        child = moved->right;
+        if (moved->parent == node)
+        {
+            child->parent = moved;
+        }
+        else
+        {
+            tree_transplant(heap, moved, moved->right);
+            moved->right = node->right;
+            moved->right->parent = moved;
+        }
+        tree_transplant(heap, node, moved);
+        moved->left = node->left;
+        moved->left->parent = moved;
+        moved->red = node->red;
     }
-    // Check if a big enough block was found
-    if (current == free_head)
+
+    // Removing a black node leaves child a black short, which is pushed up the tree
+    // until a red node absorbs it
+    while (!moved_red && child != heap->free_tree && !child->red)
     {
-        // No block found, extend the heap
-        current = extend(size);
+        tree_block_t *parent = child->parent;
+        bool child_left = child == parent->left;
+        tree_block_t *sibling = child_left ? parent->right : parent->left;
+        if (sibling->red)
+        {
+            sibling->red = false;
+            parent->red = true;
+            tree_rotate(heap, parent, child_left);
+            sibling = child_left ? parent->right : parent->left;
+        }
+        tree_block_t *near = child_left ? sibling->left : sibling->right;
+        tree_block_t *far = child_left ? sibling->right : sibling->left;
+        if (!near->red && !far->red)
+        {
+            sibling->red = true;
+            child = parent;
+            continue;
+        }
+        if (!far->red)
+        {
+            near->red = false;
+            sibling->red = true;
+            tree_rotate(heap, sibling, !child_left);
+            sibling = child_left ? parent->right : parent->left;
+            far = child_left ? sibling->right : sibling->left;
+        }
+        sibling->red = parent->red;
+        parent->red = false;
+        far->red = false;
+        tree_rotate(heap, parent, child_left);
+        child = heap->free_tree;
     }
-    return current;
+    child->red = false;
+    node->left = NULL;
+    node->right = NULL;
 }
 
 /*
- * put_sbrk_block - Initializes a sbrk_block at the given address with the given size
- * and puts it at the head of the block list.
+ * tree_find - returns the smallest free block in the tree of at least block_size
+ * bytes, the lowest one among equal sizes, or NULL if none is large enough.
  */
-void put_sbrk_block(sbrk_block *block, size_t size)
+static memory_block_t *tree_find(uheap_t *heap, size_t block_size)
 {
-    block->sbrk_start = (uint64_t)(((void *)block) + get_padded_size(sizeof(sbrk_block)));
-    block->sbrk_end = (uint64_t)((void *)block->sbrk_start) + size;
-    block->next = block_head;
-    block_head = block;
+    tree_block_t *best = NULL;
+    tree_block_t *node = heap->free_tree;
+    while (node != &heap->tree_nil)
+    {
+        if (get_size((memory_block_t *)node) >= block_size)
+        {
+            best = node;
+            node = node->left;
+        }
+        else
+        {
+            node = node->right;
+        }
+    }
+    return (memory_block_t *)best;
 }
 
 /*
- * extend - extends the heap if more memory is required. Returns NULL if an error occurred.
+ * tree_first - returns the smallest free block in the tree, or NULL if it is empty.
  */
-memory_block_t *extend(size_t size)
+tree_block_t *tree_first(uheap_t *heap)
 {
-    int sbrk_block_size = get_padded_size(sizeof(sbrk_block));
-    size_t extend_size = get_padded_size(heap_size * 2 + size);
-    int max_size = ALIGNMENT * PAGESIZE - HEADER_SIZE - sbrk_block_size;
-    // Ensure size is not too large to store
-    if (size > max_size)
+    tree_block_t *node = heap->free_tree;
+    if (node == &heap->tree_nil)
     {
-        // size is greater than the largest possible block size
         return NULL;
     }
-    // Ensure extension is not too large
-    if (extend_size > max_size)
+    while (node->left != &heap->tree_nil)
     {
-        extend_size = max_size;
+        node = node->left;
     }
-    heap_size += extend_size;
-    void *result = csbrk(get_block_size(extend_size) + sbrk_block_size);
-    if (result == NULL)
+    return node;
+}
+
+/*
+ * tree_next - returns the free block following node in the tree, or NULL if node
+ * is the largest.
+ */
+tree_block_t *tree_next(uheap_t *heap, tree_block_t *node)
+{
+    tree_block_t *nil = &heap->tree_nil;
+    if (node->right != nil)
     {
-        return NULL;
+        node = node->right;
+        while (node->left != nil)
+        {
+            node = node->left;
+        }
+        return node;
+    }
+    while (node->parent != nil && node == node->parent->right)
+    {
+        node = node->parent;
     }
+    return node->parent != nil ? node->parent : NULL;
+}
 
-    // Create the sbrk block
-    put_sbrk_block(result, get_block_size(extend_size));
-    // Set result to the start of the sbrk block
-    result = (void *)block_head->sbrk_start;
-    put_block(result, extend_size, false);
-    // This method should only be called if there isn't a free block big enough for the request
-    // As such, the newly allocated block should be the biggest.
-    insert_at_end(result);
-    return result;
+/*
+ * is_wilderness - returns true if block is the top block of the wilderness region.
+ */
+static inline bool is_wilderness(uheap_t *heap, memory_block_t *block)
+{
+    return heap->wilderness_region != NULL &&
+           (uint64_t)get_above_header(block) == heap->wilderness_region->sbrk_end - HEADER_SIZE;
 }
 
 /*
- * split - splits a given block in parts, one allocated, one free.
- * Removes the allocated block from the free list while inserting the free block.
- * Returns the allocated block.
+ * touch_wilderness - records that the wilderness region may have been written
+ * below end, so that its memory there no longer counts as fresh.
  */
-memory_block_t *split(memory_block_t *block, size_t size)
+static inline void touch_wilderness(uheap_t *heap, uint64_t end)
 {
-    remove_from_list(block);
-    size_t remaining_size = get_size(block) - get_padded_size(size);
-    // Check that there's enough remaining size to split the block
-    if (remaining_size < (HEADER_SIZE + ALIGNMENT))
+    if (end > heap->fresh)
     {
-        // Not enough remaining space, don't split
-        allocate(block);
-        return block;
+        heap->fresh = end;
     }
-    // Create the allocated block
-    put_block(block, get_padded_size(size), true);
-    // Create the free block
-    memory_block_t *free = get_above_header(block);
-    put_block(free, remaining_size - HEADER_SIZE, false);
-    insert(free);
-
-    // Return allocated block
-    return block;
 }
 
 /*
- * contained_in_block - Returns true if the given pointer lies in one of
- * the allocated blocks given by csbrk.
+ * insert - inserts the given free block at the head of the bin for its size and
+ * marks the bin as non-empty in the bitmaps. Blocks of at least TREE_MIN_SIZE
+ * bytes go into the tree instead, and the top block of the wilderness region
+ * becomes the wilderness without entering either.
  */
-bool contained_in_block(void *ptr)
+void insert(uheap_t *heap, memory_block_t *block)
 {
-    sbrk_block *temp = block_head;
-    uint64_t address = (uint64_t)ptr;
-    // Loop through each sbrk block
-    while (temp != NULL)
+    heap->free_size += get_size(block);
+    if (is_wilderness(heap, block))
     {
-        // Check if pointer lies in temp
-        if (address >= temp->sbrk_start && address < temp->sbrk_end)
-        {
-            return true;
-        }
-        temp = temp->next;
+        heap->wilderness = block;
+        return;
+    }
+    if (get_size(block) >= TREE_MIN_SIZE)
+    {
+        tree_insert(heap, (tree_block_t *)block);
+        return;
     }
 
-    return false;
+    int fl, sl;
+    mapping_insert(get_size(block), &fl, &sl);
+    assert(fl < FL_INDEX_COUNT);
+
+    memory_block_t *head = heap->free_bins[fl][sl];
+    // Check if bin is empty
+    if (head == NULL)
+    {
+        // Insert block as only element
+        block->next = block;
+        block->prev = block;
+    }
+    else
+    {
+        // Insert block at start
+        block->next = head;
+        block->prev = head->prev;
+        head->prev->next = block;
+        head->prev = block;
+    }
+    heap->free_bins[fl][sl] = block;
+    heap->fl_bitmap |= 1U << fl;
+    heap->sl_bitmap[fl] |= 1U << sl;
 }
 
 /*
- * coalesce - coalesces a free memory block with neighbors.
+ * print_list - Prints out the addresses of each element of every non-empty bin
+ * of the given heap, and of the tree in order
  */
-memory_block_t *coalesce(memory_block_t *block)
+void print_list(uheap_t *heap)
 {
-
-    // Check above
-    memory_block_t *above = get_above_header(block);
-    // Check magic number
-    if (contained_in_block((void *)above) && above->magic_number == MAGIC_NUMBER)
+    for (int fl = 0; fl < FL_INDEX_COUNT; fl++)
     {
-        if (!is_allocated(above))
+        for (int sl = 0; sl < SL_INDEX_COUNT; sl++)
         {
-            // Found free neighbor. Create new combined block
-            remove_from_list(block);
-            remove_from_list(above);
-            size_t combined_size = get_size(block) + get_size(above) + HEADER_SIZE;
-            put_block(block, combined_size, false);
+            memory_block_t *head = heap->free_bins[fl][sl];
+            if (head == NULL)
+            {
+                continue;
+            }
+            printf("Bin [%d][%d]: ", fl, sl);
+            memory_block_t *temp = head;
+            do
+            {
+                printf("Address: %p, ", temp);
+                temp = temp->next;
+            } while (temp != head);
+            printf("\n");
         }
     }
-
-    // Check below
-    footer_t *below = get_below_footer(block);
-    // Check magic number
-    if (contained_in_block((void *)below) && below->magic_number == MAGIC_NUMBER)
+    if (heap->free_tree != &heap->tree_nil)
     {
-        memory_block_t *below_head = get_header(below);
-        if (!is_allocated(below_head))
+        printf("Tree: ");
+        for (tree_block_t *node = tree_first(heap); node != NULL; node = tree_next(heap, node))
         {
-            // Found free neighbor. Create new combined block
-            remove_from_list(block);
-            remove_from_list(below_head);
-            size_t combined_size = get_size(block) + get_size(below_head) + HEADER_SIZE;
-            put_block(below_head, combined_size, false);
-            block = below_head;
+            printf("Address: %p, ", node);
         }
+        printf("\n");
     }
-
-    return block;
 }
 
 /*
- * get_padded_size - returns size with padding so that it will mainain alignment
+ * remove_from_list - removes the given block from its bin or the tree if it is
+ * present, clearing the bitmap bits of the bin once it becomes empty.
  */
-
-size_t get_padded_size(size_t size)
+void remove_from_list(uheap_t *heap, memory_block_t *block)
 {
-    int remainder = size % ALIGNMENT;
-    if (remainder == 0)
+    if (block == heap->wilderness)
     {
-        return size;
+        heap->free_size -= get_size(block);
+        heap->wilderness = NULL;
+        return;
+    }
+    // Check that the block is still in a bin
+    if (block->next == NULL || block->prev == NULL)
+    {
+        return;
+    }
+
+    heap->free_size -= get_size(block);
+    if (get_size(block) >= TREE_MIN_SIZE)
+    {
+        tree_remove(heap, (tree_block_t *)block);
+        return;
+    }
+
+    int fl, sl;
+    mapping_insert(get_size(block), &fl, &sl);
+    if (block->next == block)
+    {
+        // block is the only element in the bin
+        heap->free_bins[fl][sl] = NULL;
+        heap->sl_bitmap[fl] &= ~(1U << sl);
+        if (heap->sl_bitmap[fl] == 0)
+        {
+            heap->fl_bitmap &= ~(1U << fl);
+        }
     }
     else
     {
-        return size + (ALIGNMENT - (size % ALIGNMENT));
+        block->prev->next = block->next;
+        block->next->prev = block->prev;
+
+        if (heap->free_bins[fl][sl] == block)
+        {
+            // Update the head of the bin
+            heap->free_bins[fl][sl] = block->next;
+        }
     }
+    block->prev = NULL;
+    block->next = NULL;
 }
 
 /*
- * get_block_size - returns the total size needed to store a block with the given size
+ * get_above_header - returns a pointer to the header of the block above the given block
  */
-size_t get_block_size(size_t size)
+memory_block_t *get_above_header(memory_block_t *block)
 {
-    return get_padded_size(size) + HEADER_SIZE;
+    return (memory_block_t *)(((void *)block) + get_size(block));
 }
 
 /*
- * uinit - Used initialize metadata required to manage the heap
- * along with allocating initial memory.
+ * get_below_footer - returns a pointer to the footer of the block below the given block
  */
-int uinit()
+footer_t *get_below_footer(memory_block_t *block)
 {
-    block_head = NULL;
-    size_t initial_size = (ALIGNMENT * 5);
-    // Create initial heap
-    memory_block_t *result = extend(initial_size);
-    if (result == NULL)
+    return ((footer_t *)block) - 1;
+}
+
+/*
+ * next_bin - moves fl and sl to the first non-empty bin at or after them. Returns
+ * false if there is none.
+ */
+static bool next_bin(uheap_t *heap, int *fl, int *sl)
+{
+    if (*fl >= FL_INDEX_COUNT)
     {
-        return -1;
+        return false;
     }
-    return 0;
+    // Look for a non-empty bin in the same first level class
+    unsigned int sl_map = *sl < SL_INDEX_COUNT ? heap->sl_bitmap[*fl] & (~0U << *sl) : 0;
+    if (sl_map == 0)
+    {
+        // Fall back to the next non-empty first level class
+        unsigned int fl_map = (*fl + 1 < FL_INDEX_COUNT) ? heap->fl_bitmap & (~0U << (*fl + 1)) : 0;
+        if (fl_map == 0)
+        {
+            return false;
+        }
+        *fl = ffs(fl_map);
+        sl_map = heap->sl_bitmap[*fl];
+    }
+    *sl = ffs(sl_map);
+    return true;
 }
 
 /*
- * umalloc -  allocates size bytes and returns a pointer to the allocated memory.
- * Returns NULL if an error occurs.
+ * find_tlsf - returns the head of the first bin whose blocks all fit block_size
+ * bytes (good fit), after a look at the head of the bin the size maps into.
  */
-void *umalloc(size_t size)
+static memory_block_t *find_tlsf(uheap_t *heap, size_t block_size)
 {
-    memory_block_t *block = find(size);
-    if (block == NULL)
+    int fl, sl;
+
+    // The bin the request maps into may hold blocks smaller than the request,
+    // but its head is still worth a constant time look before rounding up.
+    mapping_insert(block_size, &fl, &sl);
+    memory_block_t *head = fl < FL_INDEX_COUNT ? heap->free_bins[fl][sl] : NULL;
+    if (head != NULL && get_size(head) >= block_size)
     {
-        return block;
+        return head;
     }
-    block = split(block, size);
-    return get_payload(block);
+
+    mapping_search(block_size, &fl, &sl);
+    return next_bin(heap, &fl, &sl) ? heap->free_bins[fl][sl] : NULL;
 }
 
 /*
- * ufree -  frees the memory space pointed to by ptr, which must have been called
- * by a previous call to malloc.
+ * find_lowest - returns the free block of at least block_size bytes with the
+ * lowest address at or above start, or with the lowest address overall if there
+ * is none above start. Every bin that may fit and the whole tree are searched.
  */
-void ufree(void *ptr)
+static memory_block_t *find_lowest(uheap_t *heap, size_t block_size, uint64_t start)
 {
-    memory_block_t *block = get_block(ptr);
-    if (block != NULL)
+    memory_block_t *lowest = NULL;
+    memory_block_t *lowest_above = NULL;
+    int fl, sl;
+    mapping_insert(block_size, &fl, &sl);
+    for (; next_bin(heap, &fl, &sl); sl++)
+    {
+        memory_block_t *head = heap->free_bins[fl][sl];
+        memory_block_t *block = head;
+        do
+        {
+            if (get_size(block) >= block_size)
+            {
+                if (lowest == NULL || block < lowest)
+                {
+                    lowest = block;
+                }
+                if ((uint64_t)block >= start && (lowest_above == NULL || block < lowest_above))
+                {
+                    lowest_above = block;
+                }
+            }
+            block = block->next;
+        } while (block != head);
+    }
+    for (tree_block_t *node = tree_first(heap); node != NULL; node = tree_next(heap, node))
     {
-        // Check valid block
-        if (contained_in_block(block) && block->magic_number == MAGIC_NUMBER)
+        memory_block_t *block = (memory_block_t *)node;
+        if (get_size(block) >= block_size)
         {
-            // Valid block, free it
-            deallocate(block);
-            block = coalesce(block);
-            insert(block);
+            if (lowest == NULL || block < lowest)
+            {
+                lowest = block;
+            }
+            if ((uint64_t)block >= start && (lowest_above == NULL || block < lowest_above))
+            {
+                lowest_above = block;
+            }
         }
     }
-}
\ No newline at end of file
+    return lowest_above != NULL ? lowest_above : lowest;
+}
+
+/*
+ * find_smallest - returns the smallest free block of at least block_size bytes
+ * among the first limit blocks that fit. Blocks in later bins are larger, so the
+ * search ends with the first bin holding a block that fits.
+ */
+static memory_block_t *find_smallest(uheap_t *heap, size_t block_size, size_t limit)
+{
+    memory_block_t *best = NULL;
+    size_t candidates = 0;
+    int fl, sl;
+    mapping_insert(block_size, &fl, &sl);
+    for (; best == NULL && next_bin(heap, &fl, &sl); sl++)
+    {
+        memory_block_t *head = heap->free_bins[fl][sl];
+        memory_block_t *block = head;
+        do
+        {
+            size_t size = get_size(block);
+            if (size >= block_size)
+            {
+                if (best == NULL || size < get_size(best))
+                {
+                    best = block;
+                }
+                if (size == block_size || ++candidates >= limit)
+                {
+                    return best;
+                }
+            }
+            block = block->next;
+        } while (block != head);
+    }
+    return best;
+}
+
+static memory_block_t *find_first_fit(uheap_t *heap, size_t block_size)
+{
+    return find_lowest(heap, block_size, 0);
+}
+
+static memory_block_t *find_next_fit(uheap_t *heap, size_t block_size)
+{
+    memory_block_t *block = find_lowest(heap, block_size, heap->rover);
+    if (block != NULL)
+    {
+        // The allocation is split off the bottom of the block
+        heap->rover = (uint64_t)block + block_size;
+    }
+    return block;
+}
+
+static memory_block_t *find_best_fit(uheap_t *heap, size_t block_size)
+{
+    return find_smallest(heap, block_size, SIZE_MAX);
+}
+
+static memory_block_t *find_good_fit(uheap_t *heap, size_t block_size)
+{
+    return find_smallest(heap, block_size, heap->options.placement_limit);
+}
+
+static const struct
+{
+    const char *name;
+    memory_block_t *(*find)(uheap_t *heap, size_t block_size);
+} placement_policies[PLACEMENT_POLICY_COUNT] = {
+    [PLACEMENT_TLSF] = {"tlsf", find_tlsf},
+    [PLACEMENT_FIRST_FIT] = {"first-fit", find_first_fit},
+    [PLACEMENT_NEXT_FIT] = {"next-fit", find_next_fit},
+    [PLACEMENT_BEST_FIT] = {"best-fit", find_best_fit},
+    [PLACEMENT_GOOD_FIT] = {"good-fit", find_good_fit},
+    [PLACEMENT_SMALL_HIGH] = {"small-high", find_tlsf},
+};
+
+/*
+ * find_fit - returns a free block of at least block_size bytes as chosen by the
+ * placement policy of the heap. Blocks in the bins are all smaller than those in
+ * the tree, so the best fit from the tree is taken when no bin has a block that
+ * fits, and the wilderness when nothing else does. Returns NULL if no free block
+ * is large enough.
+ */
+static memory_block_t *find_fit(uheap_t *heap, size_t block_size)
+{
+    memory_block_t *block = placement_policies[heap->options.placement].find(heap, block_size);
+    if (block == NULL)
+    {
+        block = tree_find(heap, block_size);
+    }
+    if (block == NULL && heap->wilderness != NULL && get_size(heap->wilderness) >= block_size)
+    {
+        // Only requests that no other free block fits eat into the wilderness
+        block = heap->wilderness;
+    }
+    return block;
+}
+
+/*
+ * find - finds a free block that can satisfy the umalloc request. The quick lists
+ * are consolidated before giving up, and the heap is extended if not enough space
+ * is available even then.
+ */
+memory_block_t *find(uheap_t *heap, size_t size)
+{
+    size_t block_size = get_block_size(size);
+    memory_block_t *block = find_fit(heap, block_size);
+    if (block == NULL && heap->quick_size > 0)
+    {
+        consolidate(heap);
+        block = find_fit(heap, block_size);
+    }
+    if (block == NULL)
+    {
+        // No block found, extend the heap
+        return extend(heap, size);
+    }
+    return block;
+}
+
+/*
+ * pagemap_alloc_node - maps a zeroed node for the page map. Nodes live outside of
+ * the heap so that they never show up as heap memory.
+ */
+static void *pagemap_alloc_node(size_t size)
+{
+    void *node = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return node == MAP_FAILED ? NULL : node;
+}
+
+/*
+ * pagemap_slot - returns the page map entry for the page holding address, creating
+ * the intermediate nodes when create is set. Returns NULL if the entry does not
+ * exist and cannot be created.
+ */
+static sbrk_block **pagemap_slot(uint64_t address, bool create)
+{
+    uint64_t page = address >> PAGE_SHIFT;
+    uint64_t root_index = page >> (PAGEMAP_MID_BITS + PAGEMAP_LEAF_BITS);
+    uint64_t mid_index = (page >> PAGEMAP_LEAF_BITS) & ((1 << PAGEMAP_MID_BITS) - 1);
+    uint64_t leaf_index = page & ((1 << PAGEMAP_LEAF_BITS) - 1);
+
+    if (root_index >= (1 << PAGEMAP_ROOT_BITS))
+    {
+        return NULL;
+    }
+    // Nodes are only added, under the os lock, and may be read without it
+    pagemap_mid_t *mid = __atomic_load_n(&pagemap_root[root_index], __ATOMIC_ACQUIRE);
+    if (mid == NULL)
+    {
+        if (!create || (mid = pagemap_alloc_node(sizeof(pagemap_mid_t))) == NULL)
+        {
+            return NULL;
+        }
+        __atomic_store_n(&pagemap_root[root_index], mid, __ATOMIC_RELEASE);
+    }
+    pagemap_leaf_t *leaf = __atomic_load_n(&mid->leaves[mid_index], __ATOMIC_ACQUIRE);
+    if (leaf == NULL)
+    {
+        if (!create || (leaf = pagemap_alloc_node(sizeof(pagemap_leaf_t))) == NULL)
+        {
+            return NULL;
+        }
+        __atomic_store_n(&mid->leaves[mid_index], leaf, __ATOMIC_RELEASE);
+    }
+    return &leaf->entries[leaf_index];
+}
+
+/*
+ * pagemap_insert - records every page of the given region in the page map. A page
+ * may be shared by the ends of several small regions, so each entry holds the
+ * region with the highest start touching the page and the rest are reached through
+ * the below links, which stay sorted by decreasing start.
+ */
+void pagemap_insert(sbrk_block *region)
+{
+    uint64_t start = (uint64_t)region;
+    uint64_t first_page = start >> PAGE_SHIFT;
+    uint64_t last_page = (region->sbrk_end - 1) >> PAGE_SHIFT;
+    region->below = NULL;
+
+    for (uint64_t page = first_page; page <= last_page; page++)
+    {
+        sbrk_block **slot = pagemap_slot(page << PAGE_SHIFT, true);
+        assert(slot != NULL);
+
+        // Find the position of the region in the page's chain
+        while (*slot != NULL && (uint64_t)(*slot) > start)
+        {
+            slot = &(*slot)->below;
+        }
+        if (page == first_page)
+        {
+            // Regions below this one can only share its first page
+            region->below = *slot;
+        }
+        // Lookups run without any lock, so publish the region fully formed
+        __atomic_store_n(slot, region, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * pagemap_remove - unlinks every page of the given region from the page map. Only
+ * the first page of a region can be shared with regions below it.
+ */
+void pagemap_remove(sbrk_block *region)
+{
+    uint64_t first_page = (uint64_t)region >> PAGE_SHIFT;
+    uint64_t last_page = (region->sbrk_end - 1) >> PAGE_SHIFT;
+
+    for (uint64_t page = first_page; page <= last_page; page++)
+    {
+        sbrk_block **slot = pagemap_slot(page << PAGE_SHIFT, false);
+        while (slot != NULL && *slot != NULL && *slot != region)
+        {
+            slot = &(*slot)->below;
+        }
+        if (slot != NULL && *slot == region)
+        {
+            __atomic_store_n(slot, page == first_page ? region->below : NULL, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/*
+ * pagemap_extend - records the pages a region gained when it grew from old_end.
+ * The new pages lie above the program break they were taken from, so no other
+ * region shares them.
+ */
+void pagemap_extend(sbrk_block *region, uint64_t old_end)
+{
+    uint64_t first_page = ((old_end - 1) >> PAGE_SHIFT) + 1;
+    uint64_t last_page = (region->sbrk_end - 1) >> PAGE_SHIFT;
+
+    for (uint64_t page = first_page; page <= last_page; page++)
+    {
+        sbrk_block **slot = pagemap_slot(page << PAGE_SHIFT, true);
+        assert(slot != NULL && *slot == NULL);
+        __atomic_store_n(slot, region, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * pagemap_shrink - forgets the pages a region lost when its end was lowered to
+ * new_end.
+ */
+void pagemap_shrink(sbrk_block *region, uint64_t new_end)
+{
+    uint64_t first_page = ((new_end - 1) >> PAGE_SHIFT) + 1;
+    uint64_t last_page = (region->sbrk_end - 1) >> PAGE_SHIFT;
+
+    for (uint64_t page = first_page; page <= last_page; page++)
+    {
+        sbrk_block **slot = pagemap_slot(page << PAGE_SHIFT, false);
+        if (slot != NULL && *slot == region)
+        {
+            __atomic_store_n(slot, NULL, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/*
+ * pagemap_lookup - returns the region containing the given address, or NULL if the
+ * address is not part of any region managed by umalloc. Runs without a lock, so
+ * the end of the region, which moves when it grows or is trimmed, is read with
+ * an acquire load pairing with the release stores of extend_in_place and
+ * trim_region.
+ */
+sbrk_block *pagemap_lookup(void *ptr)
+{
+    uint64_t address = (uint64_t)ptr;
+    sbrk_block **slot = pagemap_slot(address, false);
+    if (slot == NULL)
+    {
+        return NULL;
+    }
+
+    // Walk down the regions sharing the page until one starts at or below address
+    sbrk_block *region = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    while (region != NULL && address < (uint64_t)region)
+    {
+        region = __atomic_load_n(&region->below, __ATOMIC_ACQUIRE);
+    }
+    if (region == NULL || address >= __atomic_load_n(&region->sbrk_end, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    return region;
+}
+
+/*
+ * region_alloc - returns at least size bytes for a new region, storing the number
+ * of bytes actually handed out in actual. Spare chunks are used first fit before
+ * csbrk is called. If fresh is not NULL, it is set to whether the memory comes
+ * straight from csbrk. Returns NULL if an error occurred.
+ */
+static void *region_alloc(size_t size, size_t *actual, bool *fresh)
+{
+    LOCK_OS();
+    spare_chunk_t **link = &spare_chunks;
+    while (*link != NULL && (*link)->size < size)
+    {
+        link = &(*link)->next;
+    }
+    spare_chunk_t *chunk = *link;
+    if (fresh != NULL)
+    {
+        *fresh = chunk == NULL;
+    }
+    if (chunk == NULL)
+    {
+        *actual = size;
+        void *result = csbrk(size);
+        UNLOCK_OS();
+        // sbrk fails with -1, which region consumers would take for memory
+        return result == (void *)-1 ? NULL : result;
+    }
+    if (chunk->size - size >= SPARE_MIN_SIZE)
+    {
+        // Keep the upper part of the chunk as spare
+        spare_chunk_t *rest = ((void *)chunk) + size;
+        rest->size = chunk->size - size;
+        rest->next = chunk->next;
+        *link = rest;
+        *actual = size;
+    }
+    else
+    {
+        *link = chunk->next;
+        *actual = chunk->size;
+    }
+    UNLOCK_OS();
+    return chunk;
+}
+
+/*
+ * region_release - keeps size bytes at start as a spare chunk for later regions,
+ * merging it with adjacent spare chunks.
+ */
+static void region_release(void *start, size_t size)
+{
+    if (size < SPARE_MIN_SIZE)
+    {
+        return;
+    }
+    LOCK_OS();
+    spare_chunk_t *chunk = start;
+    spare_chunk_t **link = &spare_chunks;
+    spare_chunk_t *below = NULL;
+    while (*link != NULL && (void *)*link < start)
+    {
+        below = *link;
+        link = &(*link)->next;
+    }
+    chunk->size = size;
+    chunk->next = *link;
+    if (chunk->next != NULL && start + size == (void *)chunk->next)
+    {
+        // Absorb the chunk above
+        chunk->size += chunk->next->size;
+        chunk->next = chunk->next->next;
+    }
+    if (below != NULL && ((void *)below) + below->size == start)
+    {
+        // Merge into the chunk below
+        below->size += chunk->size;
+        below->next = chunk->next;
+    }
+    else
+    {
+        *link = chunk;
+    }
+    UNLOCK_OS();
+}
+
+/*
+ * put_sbrk_block - Initializes a sbrk_block at the given address spanning size
+ * bytes and puts it at the head of the block list of the heap. The blocks of the
+ * region start at sbrk_start, placed so that payloads are aligned, and the region
+ * ends with an allocated epilogue header of size 0 that stops coalescing at the top.
+ */
+void put_sbrk_block(uheap_t *heap, sbrk_block *block, size_t size)
+{
+    block->sbrk_start = (uint64_t)(((void *)block) + get_padded_size(sizeof(sbrk_block)) + HEADER_SIZE);
+    block->sbrk_end = (uint64_t)(((void *)block) + size);
+    block->kind = REGION_HEAP;
+    block->heap = heap;
+    block->next = heap->block_head;
+    heap->block_head = block;
+    LOCK_OS();
+    pagemap_insert(block);
+    UNLOCK_OS();
+
+    memory_block_t *epilogue = (memory_block_t *)(block->sbrk_end - HEADER_SIZE);
+    epilogue->block_size_alloc = ALLOC_BIT;
+}
+
+// Requests the adaptive policy leaves room for in a new region, and the share of
+// the heap it adds on top while most of the heap is in use.
+#define GROWTH_RECENT_COUNT 8
+#define GROWTH_FULL_DIVISOR 2
+
+/*
+ * The growth policies. Each returns how many bytes of blocks to add to the heap
+ * when need more bytes are missing, either at the top of the region below the
+ * program break (in_place) or as a new region. The result is rounded and capped
+ * by extend.
+ */
+static size_t grow_fixed(uheap_t *heap, size_t need, bool in_place)
+{
+    return need > heap->options.growth_chunk ? need : heap->options.growth_chunk;
+}
+
+static size_t grow_geometric(uheap_t *heap, size_t need, bool in_place)
+{
+    return in_place ? need : heap->heap_size * 2 + need;
+}
+
+static size_t grow_adaptive(uheap_t *heap, size_t need, bool in_place)
+{
+    size_t grow = need;
+    // A new region leaves room for a few more requests like the recent ones,
+    // while the region below the break can simply grow again later
+    if (!in_place)
+    {
+        grow += GROWTH_RECENT_COUNT * heap->recent_size;
+    }
+    // A heap with little free memory left keeps growing, so grow along with it
+    size_t live = heap->heap_size - heap->free_size;
+    if (live * 4 >= heap->heap_size * 3)
+    {
+        grow += heap->heap_size / GROWTH_FULL_DIVISOR;
+    }
+    return grow;
+}
+
+static const struct
+{
+    const char *name;
+    size_t (*grow)(uheap_t *heap, size_t need, bool in_place);
+} growth_policies[GROWTH_POLICY_COUNT] = {
+    [GROWTH_FIXED] = {"fixed", grow_fixed},
+    [GROWTH_GEOMETRIC] = {"geometric", grow_geometric},
+    [GROWTH_ADAPTIVE] = {"adaptive", grow_adaptive},
+};
+
+/*
+ * set_wilderness - makes region the wilderness region. Its top free block becomes
+ * the wilderness, and the old wilderness goes into the bins or tree.
+ */
+static void set_wilderness(uheap_t *heap, sbrk_block *region)
+{
+    if (heap->wilderness_region == region)
+    {
+        return;
+    }
+    memory_block_t *old = heap->wilderness;
+    if (old != NULL)
+    {
+        remove_from_list(heap, old);
+    }
+    heap->wilderness_region = region;
+    // Nothing is known about the memory of a region grown before
+    heap->fresh = region->sbrk_end;
+    if (old != NULL)
+    {
+        insert(heap, old);
+    }
+    memory_block_t *epilogue = (memory_block_t *)(region->sbrk_end - HEADER_SIZE);
+    if (is_prev_free(epilogue))
+    {
+        memory_block_t *top = get_header(get_below_footer(epilogue));
+        remove_from_list(heap, top);
+        insert(heap, top);
+    }
+}
+
+/*
+ * extend - extends the heap if more memory is required, by as much as the growth
+ * policy of the heap asks for. The grown region becomes the wilderness region.
+ * Returns NULL if an error occurred.
+ */
+memory_block_t *extend(uheap_t *heap, size_t size)
+{
+    // Region header, alignment pad and epilogue
+    int region_overhead = get_padded_size(sizeof(sbrk_block)) + 2 * HEADER_SIZE;
+    size_t block_size = get_block_size(size);
+    size_t (*grow)(uheap_t *, size_t, bool) = growth_policies[heap->options.growth_policy].grow;
+    size_t extend_size = get_padded_size(grow(heap, block_size, false));
+    size_t max_size = REGION_MAX_SIZE - region_overhead;
+    // Ensure size is not too large to store
+    if (block_size > max_size)
+    {
+        // size is greater than the largest possible block size
+        return NULL;
+    }
+    // Ensure extension is not too large
+    if (extend_size > max_size)
+    {
+        extend_size = max_size;
+    }
+
+    // Grow the region right below the program break instead of starting a new one,
+    // so that its top free block keeps coalescing with the new memory. The break
+    // is read under the OS lock, and checked again by extend_in_place.
+    LOCK_OS();
+    void *brk = sbrk(0);
+    UNLOCK_OS();
+    for (sbrk_block *region = heap->block_head; region != NULL; region = region->next)
+    {
+        if ((void *)region->sbrk_end != brk)
+        {
+            continue;
+        }
+        // The free block at the top of the region already covers part of the request,
+        // and growing in whole pages is enough since no region header is needed
+        memory_block_t *epilogue = (memory_block_t *)(region->sbrk_end - HEADER_SIZE);
+        size_t top_size = is_prev_free(epilogue) ? get_size_footer(get_below_footer(epilogue)) : 0;
+        size_t increment = grow(heap, block_size - top_size, true);
+        increment = (increment + PAGESIZE - 1) & ~((size_t)PAGESIZE - 1);
+        if (increment > REGION_MAX_SIZE)
+        {
+            increment = REGION_MAX_SIZE;
+        }
+        set_wilderness(heap, region);
+        memory_block_t *result = extend_in_place(heap, region, increment);
+        if (result != NULL)
+        {
+            return result;
+        }
+        break;
+    }
+
+    size_t region_size;
+    bool fresh;
+    void *result = region_alloc(extend_size + region_overhead, &region_size, &fresh);
+    if (result == NULL)
+    {
+        return NULL;
+    }
+    // A spare chunk may be a little larger than asked for
+    extend_size = region_size - region_overhead;
+    heap->heap_size += extend_size;
+    heap->stats.extend_count++;
+    heap->stats.region_count++;
+
+    // Create the sbrk block
+    put_sbrk_block(heap, result, region_size);
+    set_wilderness(heap, heap->block_head);
+    // Set result to the start of the sbrk block
+    result = (void *)heap->block_head->sbrk_start;
+    put_block(result, extend_size, false);
+    insert(heap, result);
+    if (fresh)
+    {
+        // The kernel zeroed every page past the old break, but the page holding
+        // the break may have been written before it was lowered
+        uint64_t page = ((uint64_t)heap->block_head + PAGESIZE - 1) & ~((uint64_t)PAGESIZE - 1);
+        heap->fresh = (uint64_t)get_payload(result);
+        touch_wilderness(heap, page);
+    }
+    return result;
+}
+
+/*
+ * extend_in_place - grows a region that ends at the program break by increment
+ * bytes. The old epilogue becomes the header of a free block covering the new
+ * space, which is merged with a free block at the top of the region. Counts as an
+ * extend in the heap stats. Returns the free block, or NULL if the region does not
+ * end at the break or an error occurred.
+ */
+memory_block_t *extend_in_place(uheap_t *heap, sbrk_block *region, size_t increment)
+{
+    assert(increment % ALIGNMENT == 0 && increment >= MIN_BLOCK_SIZE);
+    LOCK_OS();
+    if (sbrk(0) != (void *)region->sbrk_end)
+    {
+        // Someone else took the memory right above the region
+        UNLOCK_OS();
+        return NULL;
+    }
+    void *result = csbrk(increment);
+    if (result == NULL || result == (void *)-1)
+    {
+        UNLOCK_OS();
+        return NULL;
+    }
+    uint64_t old_end = region->sbrk_end;
+    __atomic_store_n(&region->sbrk_end, old_end + increment, __ATOMIC_RELEASE);
+    pagemap_extend(region, old_end);
+    UNLOCK_OS();
+    heap->heap_size += increment;
+    heap->stats.extend_count++;
+    if (region == heap->wilderness_region)
+    {
+        // Only whole pages past the old break are known to be zero, since the
+        // old epilogue and top footer end up inside the new free block
+        heap->fresh = (old_end + PAGESIZE - 1) & ~((uint64_t)PAGESIZE - 1);
+    }
+
+    memory_block_t *epilogue = (memory_block_t *)(region->sbrk_end - HEADER_SIZE);
+    epilogue->block_size_alloc = ALLOC_BIT;
+    memory_block_t *block = (memory_block_t *)(old_end - HEADER_SIZE);
+    block->block_size_alloc = increment | (block->block_size_alloc & PREV_FREE_BIT);
+    block = coalesce(heap, block);
+    insert(heap, block);
+    return block;
+}
+
+/*
+ * trim_region - lowers the program break into the free block at the top of a
+ * region that ends at the break, keeping pad bytes of the block. Must be called
+ * with the heap lock held. Returns the number of bytes given back to the OS.
+ */
+static size_t trim_region(uheap_t *heap, sbrk_block *region, size_t pad)
+{
+    memory_block_t *epilogue = (memory_block_t *)(region->sbrk_end - HEADER_SIZE);
+    if (!is_prev_free(epilogue))
+    {
+        return 0;
+    }
+    memory_block_t *top = get_header(get_below_footer(epilogue));
+    size_t size = get_size(top);
+    size_t keep = get_padded_size(pad) + MIN_BLOCK_SIZE;
+    if (size < keep + PAGESIZE)
+    {
+        return 0;
+    }
+    size_t release = (size - keep) & ~((size_t)PAGESIZE - 1);
+
+    LOCK_OS();
+    if (sbrk(0) != (void *)region->sbrk_end || csbrk(-(intptr_t)release) == (void *)-1)
+    {
+        UNLOCK_OS();
+        return 0;
+    }
+    uint64_t new_end = region->sbrk_end - release;
+    pagemap_shrink(region, new_end);
+    __atomic_store_n(&region->sbrk_end, new_end, __ATOMIC_RELEASE);
+    UNLOCK_OS();
+    heap->heap_size -= release;
+    heap->stats.trimmed_bytes += release;
+
+    // Move the epilogue down and shrink the top block under it
+    remove_from_list(heap, top);
+    epilogue = (memory_block_t *)(new_end - HEADER_SIZE);
+    epilogue->block_size_alloc = ALLOC_BIT;
+    put_block(top, size - release, false);
+    insert(heap, top);
+    return release;
+}
+
+/*
+ * release_pages - hands the pages of a free block lying within [start, end) back to
+ * the OS without unmapping them, keeping the pages holding the block's header,
+ * list links or tree node and footer. The memory reads as zeros once it is touched again.
+ */
+static size_t release_pages(memory_block_t *block, uint64_t start, uint64_t end)
+{
+    uint64_t inner_start = (uint64_t)block + sizeof(tree_block_t);
+    uint64_t inner_end = (uint64_t)get_footer(block);
+    start = start > inner_start ? start : inner_start;
+    end = end < inner_end ? end : inner_end;
+    start = (start + PAGESIZE - 1) & ~((uint64_t)PAGESIZE - 1);
+    end &= ~((uint64_t)PAGESIZE - 1);
+    if (end <= start || madvise((void *)start, end - start, MADV_DONTNEED) != 0)
+    {
+        return 0;
+    }
+    return end - start;
+}
+
+/*
+ * split - splits a given block in parts, one allocated, one free.
+ * Removes the allocated block from the free list while inserting the free block.
+ * The allocated block takes the low addresses, except for small blocks under the
+ * small-high placement policy, which keeps them away from the large ones.
+ * Returns the allocated block.
+ */
+memory_block_t *split(uheap_t *heap, memory_block_t *block, size_t size)
+{
+    size_t block_size = get_block_size(size);
+    size_t remaining_size = get_size(block) - block_size;
+    if (block == heap->wilderness && remaining_size >= MIN_BLOCK_SIZE &&
+        heap->options.placement != PLACEMENT_SMALL_HIGH)
+    {
+        // Carve the allocation off the bottom of the wilderness by bumping its
+        // start, which leaves the lists alone. The block below it is never free.
+        memory_block_t *wilderness = (memory_block_t *)((void *)block + block_size);
+        wilderness->block_size_alloc = remaining_size;
+        get_footer(wilderness)->block_size_alloc = remaining_size;
+        block->block_size_alloc = block_size | ALLOC_BIT;
+        heap->wilderness = wilderness;
+        heap->free_size -= block_size;
+        touch_wilderness(heap, (uint64_t)get_payload(wilderness));
+        return block;
+    }
+    if (block == heap->wilderness)
+    {
+        // Only the bump above keeps track of what is left untouched
+        touch_wilderness(heap, heap->wilderness_region->sbrk_end);
+    }
+    remove_from_list(heap, block);
+    // Check that there's enough remaining size to split the block
+    if (remaining_size < MIN_BLOCK_SIZE)
+    {
+        // Not enough remaining space, don't split
+        allocate(block);
+        return block;
+    }
+    if (heap->options.placement == PLACEMENT_SMALL_HIGH && block_size < PLACEMENT_HIGH_MAX)
+    {
+        // The allocated block is written first, since the free block below sets
+        // its prev free bit
+        memory_block_t *allocated = (memory_block_t *)((void *)block + remaining_size);
+        put_block(allocated, block_size, true);
+        put_block(block, remaining_size, false);
+        insert(heap, block);
+        return allocated;
+    }
+    // Create the allocated block
+    put_block(block, block_size, true);
+    // Create the free block
+    memory_block_t *free = get_above_header(block);
+    put_block(free, remaining_size, false);
+    insert(heap, free);
+
+    // Return allocated block
+    return block;
+}
+
+/*
+ * contained_in_block - Returns true if the given pointer lies in one of
+ * the allocated blocks given by csbrk. Uses the page map, so the cost does not
+ * depend on the number of extensions.
+ */
+bool contained_in_block(void *ptr)
+{
+    sbrk_block *region = pagemap_lookup(ptr);
+    return region != NULL && (uint64_t)ptr >= region->sbrk_start;
+}
+
+/*
+ * coalesce - coalesces a block being freed with its free neighbors and writes
+ * the resulting free block, footer included, once. The block must not be in a bin.
+ * The boundary tags make this constant time: the epilogue stops the merge at the
+ * top of a region, and the prev free bit tells whether a footer sits below the
+ * header.
+ */
+memory_block_t *coalesce(uheap_t *heap, memory_block_t *block)
+{
+    size_t size = get_size(block);
+
+    // Check above
+    memory_block_t *above = get_above_header(block);
+    if (!is_allocated(above))
+    {
+        // Found free neighbor, absorb it
+        remove_from_list(heap, above);
+        size += get_size(above);
+    }
+
+    // Check below
+    if (is_prev_free(block))
+    {
+        // Found free neighbor, merge into it
+        memory_block_t *below_head = get_header(get_below_footer(block));
+        remove_from_list(heap, below_head);
+        size += get_size(below_head);
+        block = below_head;
+    }
+
+    // Create new combined block
+    put_block(block, size, false);
+    return block;
+}
+
+/*
+ * quick_push - caches a freed block in the quick list for its size. The block stays
+ * marked allocated, so its neighbors never merge with it while it waits there.
+ */
+static void quick_push(uheap_t *heap, memory_block_t *block)
+{
+    size_t size = get_size(block);
+    memory_block_t **list = &heap->quick_lists[size / ALIGNMENT];
+    block->block_size_alloc |= QUICK_BIT;
+    block->next = *list;
+    *list = block;
+    heap->quick_size += size;
+}
+
+/*
+ * quick_pop - takes the most recently freed block of exactly block_size bytes out
+ * of its quick list. Returns NULL if the list is empty.
+ */
+static memory_block_t *quick_pop(uheap_t *heap, size_t block_size)
+{
+    memory_block_t **list = &heap->quick_lists[block_size / ALIGNMENT];
+    memory_block_t *block = *list;
+    if (block != NULL)
+    {
+        *list = block->next;
+        block->block_size_alloc &= ~QUICK_BIT;
+        heap->quick_size -= block_size;
+    }
+    return block;
+}
+
+/*
+ * consolidate - empties the quick lists, coalescing every cached block with its
+ * free neighbors and inserting the result. Cached neighbors still look allocated,
+ * and merge in once their own turn comes.
+ */
+void consolidate(uheap_t *heap)
+{
+    for (int index = 0; index < QUICK_LIST_COUNT && heap->quick_size > 0; index++)
+    {
+        memory_block_t *block = heap->quick_lists[index];
+        heap->quick_lists[index] = NULL;
+        while (block != NULL)
+        {
+            memory_block_t *next = block->next;
+            heap->quick_size -= get_size(block);
+            insert(heap, coalesce(heap, block));
+            block = next;
+        }
+    }
+}
+
+/*
+ * get_padded_size - returns size with padding so that it will mainain alignment
+ */
+
+size_t get_padded_size(size_t size)
+{
+    int remainder = size % ALIGNMENT;
+    if (remainder == 0)
+    {
+        return size;
+    }
+    else
+    {
+        return size + (ALIGNMENT - (size % ALIGNMENT));
+    }
+}
+
+/*
+ * get_block_size - returns the total size needed to store a block with the given size
+ */
+size_t get_block_size(size_t size)
+{
+    size_t block_size = get_padded_size(size + HEADER_SIZE);
+    return block_size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : block_size;
+}
+
+/*
+ * valid_block - Returns true if block looks like the header of an allocated block
+ * handed out by umalloc: aligned, inside the given heap region and marked allocated
+ * with a size that stays within the region.
+ */
+static bool valid_block(sbrk_block *region, memory_block_t *block)
+{
+    if (((uint64_t)get_payload(block)) % ALIGNMENT != 0)
+    {
+        return false;
+    }
+    if (region == NULL || (uint64_t)block < region->sbrk_start || !is_allocated(block) ||
+        (block->block_size_alloc & QUICK_BIT))
+    {
+        return false;
+    }
+    size_t size = get_size(block);
+    return size >= MIN_BLOCK_SIZE && (uint64_t)block + size <= region->sbrk_end - HEADER_SIZE;
+}
+
+/*
+ * slab_class - returns the slab size class serving requests of the given size.
+ */
+int slab_class(size_t size)
+{
+    return size == 0 ? 0 : (size - 1) / ALIGNMENT;
+}
+
+/*
+ * slab_link - inserts a run at the head of a circular list of runs.
+ */
+static void slab_link(slab_run_t **list, slab_run_t *run)
+{
+    if (*list == NULL)
+    {
+        run->next = run;
+        run->prev = run;
+    }
+    else
+    {
+        run->next = *list;
+        run->prev = (*list)->prev;
+        (*list)->prev->next = run;
+        (*list)->prev = run;
+    }
+    *list = run;
+}
+
+/*
+ * slab_unlink - removes a run from the circular list of runs it is in.
+ */
+static void slab_unlink(slab_run_t **list, slab_run_t *run)
+{
+    if (run->next == run)
+    {
+        *list = NULL;
+    }
+    else
+    {
+        run->prev->next = run->next;
+        run->next->prev = run->prev;
+        if (*list == run)
+        {
+            *list = run->next;
+        }
+    }
+    run->prev = NULL;
+    run->next = NULL;
+}
+
+/*
+ * slab_new_run - returns a run formatted for the given size class with every
+ * object free. Empty runs of the heap are reused before new regions are taken.
+ * Must be called with the heap lock held. Returns NULL if an error occurred.
+ */
+static slab_run_t *slab_new_run(uheap_t *heap, int class)
+{
+    slab_run_t *run = heap->slab_empty;
+    if (run != NULL)
+    {
+        slab_unlink(&heap->slab_empty, run);
+    }
+    else
+    {
+        size_t run_size;
+        run = region_alloc(SLAB_RUN_SIZE, &run_size, NULL);
+        if (run == NULL)
+        {
+            return NULL;
+        }
+        run->region.sbrk_start = (uint64_t)(((void *)run) + get_padded_size(sizeof(slab_run_t)));
+        run->region.sbrk_end = (uint64_t)(((void *)run) + run_size);
+        run->region.kind = REGION_SLAB;
+        run->region.heap = heap;
+        run->region.next = heap->slab_head;
+        heap->slab_head = &run->region;
+        LOCK_OS();
+        pagemap_insert(&run->region);
+        UNLOCK_OS();
+    }
+
+    run->object_size = (class + 1) * ALIGNMENT;
+    run->capacity = (run->region.sbrk_end - run->region.sbrk_start) / run->object_size;
+    if (run->capacity > SLAB_MAP_WORDS * 64)
+    {
+        // A spare chunk may hold a few more objects than the bitmap tracks
+        run->capacity = SLAB_MAP_WORDS * 64;
+    }
+    run->free_count = run->capacity;
+    for (int word = 0; word < SLAB_MAP_WORDS; word++)
+    {
+        int bits = run->capacity - word * 64;
+        if (bits <= 0)
+        {
+            run->free_map[word] = 0;
+        }
+        else
+        {
+            run->free_map[word] = bits >= 64 ? ~0UL : (1UL << bits) - 1;
+        }
+    }
+    return run;
+}
+
+#ifdef UMALLOC_THREADS
+/*
+ * thread_cache_detach - pthread key destructor run when a thread exits. The cache
+ * keeps its runs and its remote free queue, and waits for a new thread to adopt it.
+ */
+static void thread_cache_detach(void *cache)
+{
+    // Caches are carved out of the blocks of their heap
+    uheap_t *heap = pagemap_lookup(cache)->heap;
+    LOCK_HEAP(heap);
+    ((thread_cache_t *)cache)->in_use = false;
+    UNLOCK_HEAP(heap);
+}
+#endif
+
+/*
+ * get_thread_cache - returns the cache of the calling thread for the given heap,
+ * adopting the cache of an exited thread or carving a new one out of the heap on
+ * first use. Returns NULL if an error occurred.
+ */
+static thread_cache_t *get_thread_cache(uheap_t *heap)
+{
+#ifdef UMALLOC_THREADS
+    thread_cache_t *cache = pthread_getspecific(heap->cache_key);
+#else
+    thread_cache_t *cache = heap->cache;
+#endif
+    if (cache != NULL)
+    {
+        return cache;
+    }
+
+    LOCK_HEAP(heap);
+    cache = heap->thread_caches;
+    while (cache != NULL && cache->in_use)
+    {
+        cache = cache->next;
+    }
+    if (cache == NULL)
+    {
+        memory_block_t *block = find(heap, sizeof(thread_cache_t));
+        if (block == NULL)
+        {
+            UNLOCK_HEAP(heap);
+            return NULL;
+        }
+        cache = get_payload(split(heap, block, sizeof(thread_cache_t)));
+        for (int class = 0; class < SLAB_CLASS_COUNT; class++)
+        {
+            cache->partial[class] = NULL;
+        }
+        cache->remote_frees = NULL;
+        cache->next = heap->thread_caches;
+        heap->thread_caches = cache;
+    }
+    cache->in_use = true;
+    UNLOCK_HEAP(heap);
+
+#ifdef UMALLOC_THREADS
+    pthread_setspecific(heap->cache_key, cache);
+#else
+    heap->cache = cache;
+#endif
+    return cache;
+}
+
+/*
+ * slab_release - returns an object to a run owned by the given cache. Objects that
+ * are already free are ignored. Empty runs beyond the first of their class go back
+ * to the empty list of the heap.
+ */
+static void slab_release(thread_cache_t *cache, slab_run_t *run, void *ptr)
+{
+    unsigned int index = ((uint64_t)ptr - run->region.sbrk_start) / run->object_size;
+    if ((run->free_map[index / 64] >> (index % 64)) & 0x1)
+    {
+        return;
+    }
+
+    int class = slab_class(run->object_size);
+    run->free_map[index / 64] |= 1UL << (index % 64);
+    run->free_count++;
+    if (run->free_count == 1)
+    {
+        // The run was full, make it available again
+        slab_link(&cache->partial[class], run);
+    }
+    else if (run->free_count == run->capacity && run->next != run)
+    {
+        // Keep one run per class, and hand other empty runs to any class
+        slab_unlink(&cache->partial[class], run);
+        uheap_t *heap = run->region.heap;
+        LOCK_HEAP(heap);
+        run->owner = NULL;
+        slab_link(&heap->slab_empty, run);
+        UNLOCK_HEAP(heap);
+    }
+}
+
+/*
+ * slab_drain_remote - takes every object other threads queued on the cache and
+ * returns them to their runs.
+ */
+static void slab_drain_remote(thread_cache_t *cache)
+{
+    void *ptr = __atomic_exchange_n(&cache->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while (ptr != NULL)
+    {
+        void *next = *(void **)ptr;
+        slab_release(cache, (slab_run_t *)pagemap_lookup(ptr), ptr);
+        ptr = next;
+    }
+}
+
+/*
+ * slab_alloc - allocates an object of the size class for size from the first run
+ * of the class owned by the calling thread. Only taking a new run needs the heap
+ * lock. Returns NULL if an error occurred.
+ */
+void *slab_alloc(uheap_t *heap, size_t size)
+{
+    thread_cache_t *cache = get_thread_cache(heap);
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    if (__atomic_load_n(&cache->remote_frees, __ATOMIC_RELAXED) != NULL)
+    {
+        slab_drain_remote(cache);
+    }
+
+    int class = slab_class(size);
+    slab_run_t *run = cache->partial[class];
+    if (run == NULL)
+    {
+        LOCK_HEAP(heap);
+        run = slab_new_run(heap, class);
+        UNLOCK_HEAP(heap);
+        if (run == NULL)
+        {
+            return NULL;
+        }
+        run->owner = cache;
+        slab_link(&cache->partial[class], run);
+    }
+
+    // Take the lowest free object of the run
+    int word = 0;
+    while (run->free_map[word] == 0)
+    {
+        word++;
+    }
+    int bit = __builtin_ctzl(run->free_map[word]);
+    run->free_map[word] &= ~(1UL << bit);
+    if (--run->free_count == 0)
+    {
+        // Full runs leave the partial list until an object comes back
+        slab_unlink(&cache->partial[class], run);
+    }
+    return (void *)(run->region.sbrk_start + (word * 64 + bit) * run->object_size);
+}
+
+/*
+ * slab_free - returns an object to the run holding it. Pointers that are not the
+ * start of an object of the run are ignored. Objects of runs owned by another
+ * thread are pushed on that thread's remote free queue without taking any lock.
+ */
+void slab_free(slab_run_t *run, void *ptr)
+{
+    uint64_t offset = (uint64_t)ptr - run->region.sbrk_start;
+    if ((uint64_t)ptr < run->region.sbrk_start || offset % run->object_size != 0 ||
+        offset / run->object_size >= run->capacity)
+    {
+        return;
+    }
+
+    thread_cache_t *cache = get_thread_cache(run->region.heap);
+    thread_cache_t *owner = run->owner;
+    if (owner == NULL)
+    {
+        // Only empty runs have no owner, so this is a double free
+        return;
+    }
+    if (owner != cache)
+    {
+        void *head = __atomic_load_n(&owner->remote_frees, __ATOMIC_RELAXED);
+        do
+        {
+            *(void **)ptr = head;
+        } while (!__atomic_compare_exchange_n(&owner->remote_frees, &head, ptr, true,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        return;
+    }
+    slab_release(cache, run, ptr);
+}
+
+/*
+ * clear_memory - zeroes size bytes at ptr. The builtin goes to the libc memset,
+ * which already clears with the widest vector stores the CPU has.
+ */
+static inline void clear_memory(void *ptr, size_t size)
+{
+    __builtin_memset(ptr, 0, size);
+}
+
+/*
+ * mmap_offset - returns the offset of the payload of a mapping at map, the first
+ * address past the mapping header aligned to alignment bytes.
+ */
+static size_t mmap_offset(uint64_t map, size_t alignment)
+{
+    uint64_t start = map + get_padded_size(sizeof(mmap_region_t));
+    return ((start + alignment - 1) & ~((uint64_t)alignment - 1)) - map;
+}
+
+/*
+ * mmap_fits - returns whether the length of a mapping holding size bytes at offset
+ * can be worked out without wrapping around.
+ */
+static bool mmap_fits(size_t offset, size_t size)
+{
+    return size <= SIZE_MAX - offset - PAGESIZE;
+}
+
+/*
+ * mmap_length - returns the length of a mapping holding size bytes at offset.
+ */
+static size_t mmap_length(size_t offset, size_t size)
+{
+    return (offset + size + PAGESIZE - 1) & ~((size_t)PAGESIZE - 1);
+}
+
+/*
+ * mmap_place - sets up the header of a mapping of the given length for the heap,
+ * with the payload at offset, and records the mapping in the page map. Must be
+ * called with the os lock held.
+ */
+static void mmap_place(uheap_t *heap, mmap_region_t *map, size_t length, size_t offset)
+{
+    map->region.sbrk_start = (uint64_t)(((void *)map) + offset);
+    map->region.sbrk_end = (uint64_t)(((void *)map) + length);
+    map->region.kind = REGION_MMAP;
+    map->region.heap = heap;
+    pagemap_insert(&map->region);
+}
+
+/*
+ * mmap_link - puts a mapping at the head of the mapping list of its heap. Must be
+ * called with the heap lock held.
+ */
+static void mmap_link(mmap_region_t *map)
+{
+    uheap_t *heap = map->region.heap;
+    map->prev = NULL;
+    map->region.next = heap->mmap_head;
+    if (heap->mmap_head != NULL)
+    {
+        ((mmap_region_t *)heap->mmap_head)->prev = &map->region;
+    }
+    heap->mmap_head = &map->region;
+}
+
+/*
+ * mmap_unlink - removes a mapping from the mapping list of its heap. Must be called
+ * with the heap lock held.
+ */
+static void mmap_unlink(mmap_region_t *map)
+{
+    uheap_t *heap = map->region.heap;
+    if (map->prev == NULL)
+    {
+        heap->mmap_head = map->region.next;
+    }
+    else
+    {
+        map->prev->next = map->region.next;
+    }
+    if (map->region.next != NULL)
+    {
+        ((mmap_region_t *)map->region.next)->prev = map->prev;
+    }
+}
+
+/*
+ * mmap_alloc - serves a large request with a mapping of its own, its payload
+ * aligned to alignment bytes. A cached mapping is reused if it fits without
+ * wasting more than a quarter of it. If zero is set, the payload reads as zeros:
+ * new mappings already do, and only a cached one is cleared. Returns NULL if an
+ * error occurred or the mapping would be too large to describe.
+ */
+void *mmap_alloc(uheap_t *heap, size_t size, size_t alignment, bool zero)
+{
+    // The header ends on an ALIGNMENT boundary, so this is the furthest the payload
+    // can be pushed by the alignment
+    size_t offset = get_padded_size(sizeof(mmap_region_t)) + alignment - ALIGNMENT;
+    if (!mmap_fits(offset, size))
+    {
+        return NULL;
+    }
+    size_t length = mmap_length(offset, size);
+    LOCK_OS();
+    int best = -1;
+    size_t best_length = 0;
+    for (int slot = 0; slot < MMAP_CACHE_SLOTS; slot++)
+    {
+        mmap_region_t *cached = mmap_cache[slot];
+        if (cached == NULL)
+        {
+            continue;
+        }
+        size_t cached_length = cached->region.sbrk_end - (uint64_t)cached;
+        if (cached_length >= length && cached_length - length <= length / 4 &&
+            (best == -1 || cached_length < best_length))
+        {
+            best = slot;
+            best_length = cached_length;
+        }
+    }
+
+    mmap_region_t *map;
+    if (best != -1)
+    {
+        map = mmap_cache[best];
+        mmap_cache[best] = NULL;
+        length = best_length;
+    }
+    else if ((map = cmmap(length)) == NULL)
+    {
+        UNLOCK_OS();
+        return NULL;
+    }
+    mmap_place(heap, map, length, mmap_offset((uint64_t)map, alignment));
+    UNLOCK_OS();
+
+    LOCK_HEAP(heap);
+    mmap_link(map);
+    UNLOCK_HEAP(heap);
+    if (zero && best != -1)
+    {
+        clear_memory((void *)map->region.sbrk_start, size);
+    }
+    return (void *)map->region.sbrk_start;
+}
+
+/*
+ * mmap_free - releases the mapping of a large request, keeping it in the cache if
+ * there is room for it.
+ */
+void mmap_free(mmap_region_t *map)
+{
+    LOCK_HEAP(map->region.heap);
+    mmap_unlink(map);
+    UNLOCK_HEAP(map->region.heap);
+
+    size_t length = map->region.sbrk_end - (uint64_t)map;
+    LOCK_OS();
+    pagemap_remove(&map->region);
+    for (int slot = 0; slot < MMAP_CACHE_SLOTS && length <= MMAP_CACHE_MAX_SIZE; slot++)
+    {
+        if (mmap_cache[slot] == NULL)
+        {
+            mmap_cache[slot] = map;
+            UNLOCK_OS();
+            return;
+        }
+    }
+    cmunmap(map, length);
+    UNLOCK_OS();
+}
+
+/*
+ * mmap_resize - resizes the mapping of a large request to hold size bytes, moving
+ * it if it cannot grow in place. The payload keeps its offset in the mapping.
+ * Returns the payload, or NULL if an error occurred or the mapping would be too
+ * large to describe, in which case the mapping is unchanged.
+ */
+static void *mmap_resize(mmap_region_t *map, size_t size)
+{
+    uheap_t *heap = map->region.heap;
+    size_t old_length = map->region.sbrk_end - (uint64_t)map;
+    size_t offset = map->region.sbrk_start - (uint64_t)map;
+    if (!mmap_fits(offset, size))
+    {
+        return NULL;
+    }
+    size_t length = mmap_length(offset, size);
+    if (length == old_length)
+    {
+        return (void *)map->region.sbrk_start;
+    }
+
+    LOCK_HEAP(heap);
+    mmap_unlink(map);
+    UNLOCK_HEAP(heap);
+
+    LOCK_OS();
+    pagemap_remove(&map->region);
+    mmap_region_t *result = cmremap(map, old_length, length);
+    if (result == NULL)
+    {
+        // Put the mapping back as it was
+        result = map;
+        length = old_length;
+    }
+    mmap_place(heap, result, length, offset);
+    UNLOCK_OS();
+
+    LOCK_HEAP(heap);
+    mmap_link(result);
+    UNLOCK_HEAP(heap);
+    return result == map && length == old_length ? NULL : (void *)result->region.sbrk_start;
+}
+
+/*
+ * growth_policy_from_env - returns the growth policy named by the UMALLOC_GROWTH
+ * environment variable, or the adaptive policy if it names none.
+ */
+static growth_policy_t growth_policy_from_env()
+{
+    const char *name = getenv("UMALLOC_GROWTH");
+    for (int policy = GROWTH_DEFAULT + 1; name != NULL && policy < GROWTH_POLICY_COUNT; policy++)
+    {
+        if (__builtin_strcmp(name, growth_policies[policy].name) == 0)
+        {
+            return policy;
+        }
+    }
+    return GROWTH_ADAPTIVE;
+}
+
+/*
+ * placement_from_env - returns the placement policy named by the UMALLOC_PLACEMENT
+ * environment variable, or the TLSF good fit if it names none.
+ */
+static placement_policy_t placement_from_env()
+{
+    const char *name = getenv("UMALLOC_PLACEMENT");
+    for (int policy = PLACEMENT_DEFAULT + 1; name != NULL && policy < PLACEMENT_POLICY_COUNT; policy++)
+    {
+        if (__builtin_strcmp(name, placement_policies[policy].name) == 0)
+        {
+            return policy;
+        }
+    }
+    return PLACEMENT_TLSF;
+}
+
+/*
+ * heap_init - sets up an empty heap with the given options, or the defaults if
+ * options is NULL, and reserves its first region. Returns -1 if an error occurred.
+ */
+static int heap_init(uheap_t *heap, const uheap_options_t *options)
+{
+    *heap = (uheap_t){0};
+    heap->free_tree = &heap->tree_nil;
+    if (options != NULL)
+    {
+        heap->options = *options;
+    }
+    if (heap->options.initial_size == 0)
+    {
+        heap->options.initial_size = ALIGNMENT * 5;
+    }
+    if (heap->options.trim_threshold == 0)
+    {
+        heap->options.trim_threshold = TRIM_THRESHOLD;
+    }
+    if (heap->options.growth_policy <= GROWTH_DEFAULT || heap->options.growth_policy >= GROWTH_POLICY_COUNT)
+    {
+        heap->options.growth_policy = growth_policy_from_env();
+    }
+    if (heap->options.growth_chunk == 0)
+    {
+        heap->options.growth_chunk = GROWTH_CHUNK;
+    }
+    if (heap->options.quick_threshold == 0)
+    {
+        heap->options.quick_threshold = QUICK_THRESHOLD;
+    }
+    heap->stats.growth_policy = growth_policies[heap->options.growth_policy].name;
+    if (heap->options.placement <= PLACEMENT_DEFAULT || heap->options.placement >= PLACEMENT_POLICY_COUNT)
+    {
+        heap->options.placement = placement_from_env();
+    }
+    if (heap->options.placement_limit == 0)
+    {
+        const char *limit = getenv("UMALLOC_PLACEMENT_LIMIT");
+        heap->options.placement_limit = limit != NULL ? strtoul(limit, NULL, 10) : 0;
+        if (heap->options.placement_limit == 0)
+        {
+            heap->options.placement_limit = PLACEMENT_LIMIT;
+        }
+    }
+    heap->stats.placement = placement_policies[heap->options.placement].name;
+#ifdef UMALLOC_THREADS
+    pthread_mutex_init(&heap->lock, NULL);
+    if (pthread_key_create(&heap->cache_key, thread_cache_detach) != 0)
+    {
+        pthread_mutex_destroy(&heap->lock);
+        return -1;
+    }
+#endif
+    heap->initialized = true;
+
+    // Create initial heap
+    if (extend(heap, heap->options.initial_size) == NULL)
+    {
+        uheap_destroy(heap);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * uheap_create - creates a new heap, independent of every other heap. options may
+ * be NULL to use the defaults. Returns NULL if an error occurred.
+ */
+uheap_t *uheap_create(const uheap_options_t *options)
+{
+    size_t size;
+    uheap_t *heap = region_alloc(get_padded_size(sizeof(uheap_t)), &size, NULL);
+    if (heap == NULL)
+    {
+        return NULL;
+    }
+    if (heap_init(heap, options) == -1)
+    {
+        region_release(heap, size);
+        return NULL;
+    }
+    return heap;
+}
+
+/*
+ * uheap_malloc - allocates size bytes from the given heap and returns a pointer to
+ * the allocated memory. Returns NULL if an error occurs.
+ */
+void *uheap_malloc(uheap_t *heap, size_t size)
+{
+    if (size <= SLAB_MAX_SIZE)
+    {
+        return slab_alloc(heap, size);
+    }
+    if (size >= MMAP_THRESHOLD)
+    {
+        return mmap_alloc(heap, size, ALIGNMENT, false);
+    }
+    size_t block_size = get_block_size(size);
+    LOCK_HEAP(heap);
+    heap->recent_size = (heap->recent_size * 7 + block_size) / 8;
+    memory_block_t *block = block_size <= QUICK_MAX_SIZE ? quick_pop(heap, block_size) : NULL;
+    if (block != NULL)
+    {
+        UNLOCK_HEAP(heap);
+        return get_payload(block);
+    }
+    block = find(heap, size);
+    if (block == NULL)
+    {
+        UNLOCK_HEAP(heap);
+        return block;
+    }
+    block = split(heap, block, size);
+    UNLOCK_HEAP(heap);
+    return get_payload(block);
+}
+
+/*
+ * uheap_aligned_alloc - allocates size bytes from the given heap with the payload
+ * aligned to alignment bytes, which must be a power of two. The block is carved
+ * out of a free block large enough for any offset: the fragment below the aligned
+ * payload and the tail above it are returned to the free lists. The result is
+ * freed with uheap_free like any other. Returns NULL if an error occurs or the
+ * request is too large to size.
+ */
+void *uheap_aligned_alloc(uheap_t *heap, size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT)
+    {
+        return uheap_malloc(heap, size);
+    }
+    if (size > SIZE_MAX - alignment - MIN_BLOCK_SIZE)
+    {
+        return NULL;
+    }
+    // Slab objects only have their size class alignment, so smaller requests use
+    // blocks too
+    size_t search_size = size + alignment + MIN_BLOCK_SIZE;
+    if (search_size >= MMAP_THRESHOLD)
+    {
+        return mmap_alloc(heap, size, alignment, false);
+    }
+    size_t block_size = get_block_size(size);
+    LOCK_HEAP(heap);
+    heap->recent_size = (heap->recent_size * 7 + block_size) / 8;
+    memory_block_t *block = find(heap, search_size);
+    if (block == NULL)
+    {
+        UNLOCK_HEAP(heap);
+        return NULL;
+    }
+
+    // The fragment below the aligned block must be empty or a block of its own
+    uint64_t payload = ((uint64_t)get_payload(block) + alignment - 1) & ~((uint64_t)alignment - 1);
+    size_t lead = payload - (uint64_t)get_payload(block);
+    if (lead > 0 && lead < MIN_BLOCK_SIZE)
+    {
+        payload += alignment;
+        lead += alignment;
+    }
+    memory_block_t *aligned = get_block((void *)payload);
+    size_t rest = get_size(block) - lead;
+    bool top = block == heap->wilderness;
+    remove_from_list(heap, block);
+
+    // The fragment is written last, since it sets the prev free bit of the aligned
+    // block above it
+    memory_block_t *tail = NULL;
+    if (rest - block_size >= MIN_BLOCK_SIZE)
+    {
+        tail = (memory_block_t *)((void *)aligned + block_size);
+        put_block(tail, rest - block_size, false);
+        rest = block_size;
+    }
+    put_block(aligned, rest, true);
+    if (tail != NULL)
+    {
+        insert(heap, tail);
+    }
+    if (top)
+    {
+        touch_wilderness(heap, tail != NULL ? (uint64_t)get_payload(tail) : heap->wilderness_region->sbrk_end);
+    }
+    if (lead > 0)
+    {
+        put_block(block, lead, false);
+        insert(heap, block);
+    }
+    UNLOCK_HEAP(heap);
+    return (void *)payload;
+}
+
+/*
+ * uheap_calloc - allocates zeroed memory for count objects of size bytes each from
+ * the given heap. Blocks carved from the untouched part of the wilderness and new
+ * mappings are zero already, so only recycled memory is cleared. Returns NULL if
+ * the total size overflows or an error occurs.
+ */
+void *uheap_calloc(uheap_t *heap, size_t count, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total))
+    {
+        return NULL;
+    }
+    if (total <= SLAB_MAX_SIZE)
+    {
+        void *object = slab_alloc(heap, total);
+        if (object != NULL)
+        {
+            clear_memory(object, total);
+        }
+        return object;
+    }
+    if (total >= MMAP_THRESHOLD)
+    {
+        return mmap_alloc(heap, total, ALIGNMENT, true);
+    }
+    size_t block_size = get_block_size(total);
+    LOCK_HEAP(heap);
+    heap->recent_size = (heap->recent_size * 7 + block_size) / 8;
+    memory_block_t *block = block_size <= QUICK_MAX_SIZE ? quick_pop(heap, block_size) : NULL;
+    bool fresh = false;
+    if (block == NULL)
+    {
+        block = find(heap, total);
+        if (block == NULL)
+        {
+            UNLOCK_HEAP(heap);
+            return NULL;
+        }
+        // A block bumped off the wilderness above the fresh mark has only ever
+        // been written by the kernel, since the wilderness footer stays above it
+        memory_block_t *wilderness = heap->wilderness;
+        uint64_t mark = heap->fresh;
+        memory_block_t *result = split(heap, block, total);
+        fresh = block == wilderness && result == block && heap->wilderness != NULL &&
+                (uint64_t)get_payload(block) >= mark;
+        block = result;
+    }
+    UNLOCK_HEAP(heap);
+    if (!fresh)
+    {
+        clear_memory(get_payload(block), total);
+    }
+    return get_payload(block);
+}
+
+/*
+ * heap_free - frees ptr, which lies in the given region, back to the heap owning
+ * the region. Pointers that were not handed out are ignored.
+ */
+static void heap_free(sbrk_block *region, void *ptr)
+{
+    if (region->kind == REGION_SLAB)
+    {
+        slab_free((slab_run_t *)region, ptr);
+        return;
+    }
+    if (region->kind == REGION_MMAP)
+    {
+        if ((uint64_t)ptr == region->sbrk_start)
+        {
+            mmap_free((mmap_region_t *)region);
+        }
+        return;
+    }
+
+    uheap_t *heap = region->heap;
+    memory_block_t *block = get_block(ptr);
+    LOCK_HEAP(heap);
+    // Check valid block
+    if (valid_block(region, block) && get_size(block) <= QUICK_MAX_SIZE)
+    {
+        // Small blocks wait uncoalesced for another request of the same size
+        quick_push(heap, block);
+        if (heap->quick_size > heap->options.quick_threshold)
+        {
+            consolidate(heap);
+        }
+    }
+    else if (valid_block(region, block))
+    {
+        // Valid block, free it
+        uint64_t start = (uint64_t)block;
+        uint64_t end = start + get_size(block);
+        block = coalesce(heap, block);
+        insert(heap, block);
+
+        // Large free blocks give their memory back, through the break at the top
+        // of the heap and page by page anywhere else
+        if (get_size(block) >= heap->options.trim_threshold &&
+            trim_region(heap, region, 0) == 0)
+        {
+            release_pages(block, start & ~((uint64_t)PAGESIZE - 1), end + PAGESIZE - 1);
+        }
+    }
+    UNLOCK_HEAP(heap);
+}
+
+/*
+ * uheap_free - frees the memory space pointed to by ptr, which must have been
+ * returned by uheap_malloc on the same heap. Pointers of other heaps are ignored.
+ */
+void uheap_free(uheap_t *heap, void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    sbrk_block *region = pagemap_lookup(ptr);
+    if (region != NULL && region->heap == heap)
+    {
+        heap_free(region, ptr);
+    }
+}
+
+/*
+ * resize_in_place - resizes an allocated block of the given region to block_size
+ * bytes without moving it. Growing absorbs the free block above, and extends the
+ * region when the block reaches its top. Shrinking splits off the tail as a free
+ * block. Must be called with the heap lock held. Returns false if the block
+ * cannot grow in place.
+ */
+static bool resize_in_place(uheap_t *heap, sbrk_block *region, memory_block_t *block, size_t block_size)
+{
+    size_t size = get_size(block);
+    memory_block_t *above = get_above_header(block);
+    if (size < block_size)
+    {
+        size_t available = size + (is_allocated(above) ? 0 : get_size(above));
+        if (available < block_size)
+        {
+            // Only a block at the top of its region can take in new memory
+            memory_block_t *top = is_allocated(above) ? above : get_above_header(above);
+            if ((uint64_t)top != region->sbrk_end - HEADER_SIZE)
+            {
+                return false;
+            }
+            size_t increment = get_padded_size(block_size - available);
+            if (extend_in_place(heap, region, increment < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : increment) == NULL)
+            {
+                return false;
+            }
+        }
+
+        // The block above is free now, absorb it
+        if (above == heap->wilderness)
+        {
+            touch_wilderness(heap, region->sbrk_end);
+        }
+        remove_from_list(heap, above);
+        size += get_size(above);
+        block->block_size_alloc = size | ALLOC_BIT | (block->block_size_alloc & PREV_FREE_BIT);
+        get_above_header(block)->block_size_alloc &= ~PREV_FREE_BIT;
+    }
+
+    // Give back the tail if it can hold a block of its own
+    size_t remaining_size = size - block_size;
+    if (remaining_size >= MIN_BLOCK_SIZE)
+    {
+        block->block_size_alloc = block_size | ALLOC_BIT | (block->block_size_alloc & PREV_FREE_BIT);
+        memory_block_t *free = get_above_header(block);
+        put_block(free, remaining_size, false);
+        insert(heap, coalesce(heap, free));
+    }
+    return true;
+}
+
+/*
+ * heap_realloc - resizes ptr, which lies in the given region, to size bytes. Blocks
+ * are resized in place when possible, and slab objects stay put while the request
+ * fits their size class. Otherwise the data is moved to a new allocation of the
+ * same heap. Returns NULL if ptr was not handed out or an error occurred.
+ */
+static void *heap_realloc(sbrk_block *region, void *ptr, size_t size)
+{
+    uheap_t *heap = region->heap;
+    size_t old_size;
+    if (region->kind == REGION_SLAB)
+    {
+        old_size = ((slab_run_t *)region)->object_size;
+        if (size <= old_size)
+        {
+            return ptr;
+        }
+    }
+    else if (region->kind == REGION_MMAP)
+    {
+        if ((uint64_t)ptr != region->sbrk_start)
+        {
+            return NULL;
+        }
+        old_size = region->sbrk_end - region->sbrk_start;
+        // Large requests stay mapped, smaller ones move back to the heap
+        void *result = size >= MMAP_THRESHOLD ? mmap_resize((mmap_region_t *)region, size) : NULL;
+        if (result != NULL)
+        {
+            return result;
+        }
+    }
+    else
+    {
+        memory_block_t *block = get_block(ptr);
+        LOCK_HEAP(heap);
+        if (!valid_block(region, block))
+        {
+            UNLOCK_HEAP(heap);
+            return NULL;
+        }
+        // Blocks never grow past the large request threshold, mappings take over
+        if (size < MMAP_THRESHOLD && resize_in_place(heap, region, block, get_block_size(size)))
+        {
+            UNLOCK_HEAP(heap);
+            return ptr;
+        }
+        old_size = get_size(block) - HEADER_SIZE;
+        UNLOCK_HEAP(heap);
+    }
+
+    // Copy as a last resort
+    void *result = uheap_malloc(heap, size);
+    if (result == NULL)
+    {
+        return NULL;
+    }
+    __builtin_memcpy(result, ptr, old_size < size ? old_size : size);
+    heap_free(region, ptr);
+    return result;
+}
+
+/*
+ * uheap_realloc - changes the size of the allocation at ptr, which must have been
+ * returned by the given heap, to size bytes, keeping its contents up to the smaller
+ * of both sizes. A NULL ptr allocates, and a size of 0 frees. Returns the possibly
+ * moved allocation, or NULL if an error occurred, in which case ptr is unchanged.
+ */
+void *uheap_realloc(uheap_t *heap, void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return uheap_malloc(heap, size);
+    }
+    if (size == 0)
+    {
+        uheap_free(heap, ptr);
+        return NULL;
+    }
+    sbrk_block *region = pagemap_lookup(ptr);
+    if (region == NULL || region->heap != heap)
+    {
+        return NULL;
+    }
+    return heap_realloc(region, ptr, size);
+}
+
+/*
+ * uheap_trim - gives as much free memory of the heap back to the OS as it can:
+ * regions ending at the program break are shrunk down to pad free bytes, and the
+ * pages inside other free blocks are released. Cached mappings of large requests
+ * are unmapped as well. Returns 1 if any memory was given back, otherwise 0.
+ */
+int uheap_trim(uheap_t *heap, size_t pad)
+{
+    size_t released = 0;
+    LOCK_HEAP(heap);
+    consolidate(heap);
+    for (sbrk_block *region = heap->block_head; region != NULL; region = region->next)
+    {
+        released += trim_region(heap, region, pad);
+    }
+    if (heap->wilderness != NULL)
+    {
+        memory_block_t *block = heap->wilderness;
+        released += release_pages(block, (uint64_t)block, (uint64_t)block + get_size(block));
+    }
+    // Only blocks spanning more than two pages have inner pages, and all of them
+    // are in the tree
+    for (tree_block_t *node = tree_first(heap); node != NULL; node = tree_next(heap, node))
+    {
+        memory_block_t *block = (memory_block_t *)node;
+        if (get_size(block) > 2 * PAGESIZE)
+        {
+            released += release_pages(block, (uint64_t)block, (uint64_t)block + get_size(block));
+        }
+    }
+    UNLOCK_HEAP(heap);
+
+    LOCK_OS();
+    for (int slot = 0; slot < MMAP_CACHE_SLOTS; slot++)
+    {
+        mmap_region_t *cached = mmap_cache[slot];
+        if (cached != NULL)
+        {
+            released += cached->region.sbrk_end - (uint64_t)cached;
+            cmunmap(cached, cached->region.sbrk_end - (uint64_t)cached);
+            mmap_cache[slot] = NULL;
+        }
+    }
+    UNLOCK_OS();
+    return released > 0;
+}
+
+/*
+ * uheap_stats - fills in stats with the counters of the heap.
+ */
+void uheap_stats(uheap_t *heap, uheap_stats_t *stats)
+{
+    LOCK_HEAP(heap);
+    *stats = heap->stats;
+    stats->heap_bytes = heap->heap_size;
+    stats->free_bytes = heap->free_size;
+    UNLOCK_HEAP(heap);
+}
+
+/*
+ * uheap_destroy - frees every allocation of the given heap at once, along with the
+ * heap itself. Its memory is kept as spare chunks for the regions of other heaps,
+ * while its large request mappings are unmapped. No thread may use the heap while it is destroyed.
+ */
+void uheap_destroy(uheap_t *heap)
+{
+    if (heap == NULL || !heap->initialized)
+    {
+        return;
+    }
+    sbrk_block *lists[] = {heap->block_head, heap->slab_head};
+    for (int list = 0; list < 2; list++)
+    {
+        sbrk_block *region = lists[list];
+        while (region != NULL)
+        {
+            // Releasing the region overwrites its header
+            sbrk_block *next = region->next;
+            LOCK_OS();
+            pagemap_remove(region);
+            UNLOCK_OS();
+            region_release(region, region->sbrk_end - (uint64_t)region);
+            region = next;
+        }
+    }
+    sbrk_block *region = heap->mmap_head;
+    while (region != NULL)
+    {
+        sbrk_block *next = region->next;
+        LOCK_OS();
+        pagemap_remove(region);
+        cmunmap(region, region->sbrk_end - (uint64_t)region);
+        UNLOCK_OS();
+        region = next;
+    }
+#ifdef UMALLOC_THREADS
+    pthread_key_delete(heap->cache_key);
+    pthread_mutex_destroy(&heap->lock);
+#endif
+    heap->initialized = false;
+    if (heap != &default_heap)
+    {
+        region_release(heap, get_padded_size(sizeof(uheap_t)));
+    }
+}
+
+/*
+ * uheap_default - returns the heap used by umalloc and ufree.
+ */
+uheap_t *uheap_default()
+{
+    return &default_heap;
+}
+
+/*
+ * uinit - Used initialize metadata required to manage the heap
+ * along with allocating initial memory.
+ */
+int uinit()
+{
+    // Start over if the default heap is already in use
+    uheap_destroy(&default_heap);
+    return heap_init(&default_heap, NULL);
+}
+
+/*
+ * umalloc -  allocates size bytes and returns a pointer to the allocated memory.
+ * Returns NULL if an error occurs.
+ */
+void *umalloc(size_t size)
+{
+    return uheap_malloc(&default_heap, size);
+}
+
+/*
+ * ufree -  frees the memory space pointed to by ptr, which must have been called
+ * by a previous call to malloc.
+ */
+void ufree(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    sbrk_block *region = pagemap_lookup(ptr);
+    if (region != NULL)
+    {
+        heap_free(region, ptr);
+    }
+}
+
+/*
+ * ualigned_alloc - allocates size bytes from the default heap with the payload
+ * aligned to alignment bytes, a power of two. Freed with ufree. Returns NULL if
+ * an error occurs.
+ */
+void *ualigned_alloc(size_t alignment, size_t size)
+{
+    return uheap_aligned_alloc(&default_heap, alignment, size);
+}
+
+/*
+ * umemalign - the same as ualigned_alloc, under the name of the old memalign.
+ */
+void *umemalign(size_t alignment, size_t size)
+{
+    return uheap_aligned_alloc(&default_heap, alignment, size);
+}
+
+/*
+ * ucalloc - allocates zeroed memory for count objects of size bytes each from the
+ * default heap. Returns NULL if the total size overflows or an error occurs.
+ */
+void *ucalloc(size_t count, size_t size)
+{
+    return uheap_calloc(&default_heap, count, size);
+}
+
+/*
+ * urealloc - changes the size of the allocation at ptr to size bytes, growing or
+ * shrinking it in place when possible. Works on allocations of any heap.
+ */
+void *urealloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return umalloc(size);
+    }
+    if (size == 0)
+    {
+        ufree(ptr);
+        return NULL;
+    }
+    sbrk_block *region = pagemap_lookup(ptr);
+    if (region == NULL)
+    {
+        return NULL;
+    }
+    return heap_realloc(region, ptr, size);
+}
+
+/*
+ * umalloc_usable_size - returns the number of bytes that can be used at ptr, which
+ * may exceed the size it was requested with. Returns 0 if ptr was not handed out.
+ */
+size_t umalloc_usable_size(void *ptr)
+{
+    sbrk_block *region = ptr == NULL ? NULL : pagemap_lookup(ptr);
+    if (region == NULL)
+    {
+        return 0;
+    }
+    if (region->kind == REGION_SLAB)
+    {
+        return ((slab_run_t *)region)->object_size;
+    }
+    if (region->kind == REGION_MMAP)
+    {
+        return (uint64_t)ptr == region->sbrk_start ? region->sbrk_end - region->sbrk_start : 0;
+    }
+    memory_block_t *block = get_block(ptr);
+    return valid_block(region, block) ? get_size(block) - HEADER_SIZE : 0;
+}
+
+/*
+ * utrim - gives free memory of the default heap back to the OS, keeping pad free
+ * bytes at the top of the heap. Returns 1 if any memory was given back.
+ */
+int utrim(size_t pad)
+{
+    return uheap_trim(&default_heap, pad);
+}
+
+/*
+ * ustats - fills in stats with the counters of the default heap.
+ */
+void ustats(uheap_stats_t *stats)
+{
+    uheap_stats(&default_heap, stats);
+}
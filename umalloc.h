@@ -1,36 +1,280 @@
 #include <stdlib.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include "csbrk.h"
 
 #define ALIGNMENT 16 /* The alignment of all payloads returned by umalloc */
 #define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1))
+#define ALIGNMENT_LOG2 4
+
+/*
+ * Parameters of the two-level segregated fit free lists. The first level divides
+ * sizes into powers of two, and the second level divides each power of two into
+ * SL_INDEX_COUNT bins. Sizes below SMALL_BLOCK_SIZE all live in first level 0,
+ * with one bin per ALIGNMENT bytes.
+ */
+#define SL_INDEX_COUNT_LOG2 4
+#define SL_INDEX_COUNT (1 << SL_INDEX_COUNT_LOG2)
+#define FL_INDEX_SHIFT (SL_INDEX_COUNT_LOG2 + ALIGNMENT_LOG2)
+#define FL_INDEX_MAX 30 /* log2 of the largest supported block size */
+#define FL_INDEX_COUNT (FL_INDEX_MAX - FL_INDEX_SHIFT + 2)
+#define SMALL_BLOCK_SIZE (1 << FL_INDEX_SHIFT)
+#define TREE_MIN_SIZE 4096 /* free blocks at least this large are kept in the tree instead */
+
+/*
+ * Parameters of the quick lists, which keep freed blocks of up to QUICK_MAX_SIZE
+ * bytes by exact size without coalescing them, until QUICK_THRESHOLD bytes pile up
+ * or a request cannot be served otherwise.
+ */
+#define QUICK_MAX_SIZE 512
+#define QUICK_LIST_COUNT (QUICK_MAX_SIZE / ALIGNMENT + 1)
+#define QUICK_THRESHOLD (4 * PAGESIZE)
+
+/*
+ * Parameters of the page map, a three level radix tree keyed by page number that
+ * maps every page of a managed region back to its sbrk_block. The levels cover
+ * 48 bit virtual addresses.
+ */
+#define PAGE_SHIFT 12
+#define PAGEMAP_LEAF_BITS 10
+#define PAGEMAP_MID_BITS 13
+#define PAGEMAP_ROOT_BITS (48 - PAGE_SHIFT - PAGEMAP_MID_BITS - PAGEMAP_LEAF_BITS)
+
+/*
+ * Parameters of the small object slabs. Requests of at most SLAB_MAX_SIZE bytes are
+ * served from page sized runs, each holding objects of a single size class, with
+ * one size class per ALIGNMENT bytes.
+ */
+#define SLAB_MAX_SIZE 128
+#define SLAB_CLASS_COUNT (SLAB_MAX_SIZE / ALIGNMENT)
+#define SLAB_RUN_SIZE PAGESIZE
+#define SLAB_MAP_WORDS (SLAB_RUN_SIZE / ALIGNMENT / 64)
+
+/*
+ * Parameters of the large object path. csbrk hands out at most REGION_MAX_SIZE
+ * bytes at once, so requests of at least MMAP_THRESHOLD bytes, which would take a
+ * whole region, get a mapping of their own instead of a block. Up to
+ * MMAP_CACHE_SLOTS freed mappings of at most MMAP_CACHE_MAX_SIZE bytes are kept
+ * for reuse.
+ */
+#define REGION_MAX_SIZE (16 * PAGESIZE)
+#define MMAP_THRESHOLD (REGION_MAX_SIZE - PAGESIZE)
+#define MMAP_CACHE_SLOTS 4
+#define MMAP_CACHE_MAX_SIZE (1024 * 1024)
+
+/*
+ * Default of the automatic trimming threshold. Once a free block of at least this
+ * many bytes forms at the top of a region ending at the program break, the break
+ * is lowered. Free blocks this large elsewhere have their inner pages released.
+ */
+#define TRIM_THRESHOLD (128 * 1024)
+
+/*
+ * region_kind_t - What a region recorded in the page map holds.
+ */
+typedef enum
+{
+    REGION_HEAP, /* blocks with boundary tags, managed by the free bins */
+    REGION_SLAB, /* a slab run of equally sized objects */
+    REGION_MMAP, /* a mapping holding a single large allocation */
+} region_kind_t;
+
+/*
+ * slab_run_t - The header of a slab run. The region bounds cover the objects,
+ * which follow the header and have no header of their own. A set bit in free_map
+ * marks a free object. Runs with free objects are linked into the partial list of
+ * their size class in the cache of the thread owning them, and runs that become
+ * empty are kept for reuse by any class.
+ */
+typedef struct slab_run_struct
+{
+    sbrk_block region;
+    struct thread_cache_struct *owner; /* the only cache that may change the bitmap */
+    struct slab_run_struct *prev;
+    struct slab_run_struct *next;
+    unsigned int object_size;
+    unsigned int capacity;
+    unsigned int free_count;
+    uint64_t free_map[SLAB_MAP_WORDS];
+} slab_run_t;
+
+/*
+ * mmap_region_t - The header of a mapping serving one large request. The region
+ * bounds cover the payload, which follows the header, up to the end of the mapping.
+ * The mappings of a heap are kept in a doubly-linked list so that they can be
+ * unmapped when the heap is destroyed.
+ */
+typedef struct mmap_region_struct
+{
+    sbrk_block region;
+    sbrk_block *prev;
+} mmap_region_t;
+
+/*
+ * thread_cache_t - The small object state of one thread: the runs it owns, by size
+ * class, and a lock-free stack of objects of those runs freed by other threads,
+ * linked through their first word. Every heap has its own caches, carved out of its
+ * blocks. Caches of exited threads are adopted by new threads, so a cache lives as
+ * long as its heap.
+ */
+typedef struct thread_cache_struct
+{
+    slab_run_t *partial[SLAB_CLASS_COUNT];
+    void *remote_frees;
+    bool in_use;
+    struct thread_cache_struct *next;
+} thread_cache_t;
 
 /*
  * memory_block_t - Represents a block of memory managed by the heap. The 
  * struct can be left as is, or modified for your design.
- * In the current design bit0 is the allocated bit
- * bits 1-3 are unused.
- * and the remaining 60 bit represent the size.
- * The struct has been modified adding the magic_number and prev fields.
- * magic_number stores a unique number used to validate the block.
- * prev stores a pointer to the previous block in the free list.
+ * In the current design bit0 is the allocated bit,
+ * bit1 is set when the block directly below is free,
+ * bit2 is set while a freed block waits uncoalesced in a quick list,
+ * bit3 is unused,
+ * and the remaining 60 bit represent the size of the whole block, header included.
+ * Only the size word is present in allocated blocks; prev and next overlay the
+ * start of the payload and are valid only while the block is free.
  */
 typedef struct memory_block_struct
 {
     size_t block_size_alloc;
-    int magic_number;
     struct memory_block_struct *prev;
     struct memory_block_struct *next;
 } memory_block_t;
 
+/*
+ * footer_t - The last word of a free block, a copy of its size. Allocated blocks
+ * have no footer, so the prev free bit of the block above tells whether one exists.
+ */
 typedef struct footer
 {
     size_t block_size_alloc;
-    int magic_number;
 } footer_t;
 
+/*
+ * tree_block_t - A free block of at least TREE_MIN_SIZE bytes, kept in a red-black
+ * tree ordered by size and then by address. The node overlays the payload, with
+ * left and right in place of prev and next.
+ */
+typedef struct tree_block
+{
+    size_t block_size_alloc;
+    struct tree_block *left;
+    struct tree_block *right;
+    struct tree_block *parent;
+    size_t red;
+} tree_block_t;
+
+#define ALLOC_BIT 0x1
+#define PREV_FREE_BIT 0x2
+#define QUICK_BIT 0x4
+#define MIN_BLOCK_SIZE ALIGN(sizeof(memory_block_t) + sizeof(footer_t))
+
+/*
+ * growth_policy_t - How much a heap grows when no free block fits a request.
+ * GROWTH_DEFAULT takes the policy named by the UMALLOC_GROWTH environment variable
+ * (fixed, geometric or adaptive), and the adaptive policy when it is not set.
+ */
+typedef enum
+{
+    GROWTH_DEFAULT,
+    GROWTH_FIXED,     /* chunks of growth_chunk bytes */
+    GROWTH_GEOMETRIC, /* twice the heap size on top of the request */
+    GROWTH_ADAPTIVE,  /* room for recent request sizes, more while the heap is full */
+    GROWTH_POLICY_COUNT
+} growth_policy_t;
+
+#define GROWTH_CHUNK (4 * PAGESIZE) /* default chunk of the fixed policy */
+
+/*
+ * placement_policy_t - Which free block a request is placed in, and where in it.
+ * PLACEMENT_DEFAULT takes the policy named by the UMALLOC_PLACEMENT environment
+ * variable (tlsf, first-fit, next-fit, best-fit, good-fit or small-high), and the
+ * TLSF good fit when it is not set.
+ */
+typedef enum
+{
+    PLACEMENT_DEFAULT,
+    PLACEMENT_TLSF,       /* head of the first bin whose blocks all fit */
+    PLACEMENT_FIRST_FIT,  /* lowest address that fits */
+    PLACEMENT_NEXT_FIT,   /* lowest address that fits above the last placement */
+    PLACEMENT_BEST_FIT,   /* smallest block that fits */
+    PLACEMENT_GOOD_FIT,   /* smallest of at most placement_limit blocks that fit */
+    PLACEMENT_SMALL_HIGH, /* TLSF, with small blocks split off the high end */
+    PLACEMENT_POLICY_COUNT
+} placement_policy_t;
+
+#define PLACEMENT_LIMIT 16      /* default candidates of the good fit policy */
+#define PLACEMENT_HIGH_MAX 1024 /* largest block the small-high policy places high */
+
+/*
+ * uheap_options_t - Settings of a heap, given to uheap_create. Zeroed fields take
+ * their default values.
+ */
+typedef struct uheap_options
+{
+    size_t initial_size;           /* payload bytes reserved when the heap is created */
+    size_t trim_threshold;         /* free bytes that trigger trimming, SIZE_MAX disables it */
+    growth_policy_t growth_policy; /* see growth_policy_t */
+    size_t growth_chunk;           /* bytes added at once by the fixed policy */
+    size_t quick_threshold;        /* bytes in the quick lists that trigger consolidation */
+    placement_policy_t placement;  /* see placement_policy_t */
+    size_t placement_limit;        /* candidates looked at by the good fit policy */
+} uheap_options_t;
+
+/*
+ * uheap_stats_t - Counters of a heap, filled in by uheap_stats.
+ */
+typedef struct uheap_stats
+{
+    const char *growth_policy; /* name of the growth policy in use */
+    const char *placement;     /* name of the placement policy in use */
+    size_t extend_count;       /* times the heap grew */
+    size_t region_count;       /* times the heap grew by starting a new region */
+    size_t heap_bytes;         /* bytes of blocks over all regions */
+    size_t free_bytes;         /* bytes of free blocks */
+    size_t trimmed_bytes;      /* bytes given back to the OS through the break */
+} uheap_stats_t;
+
+/*
+ * uheap_t - An independent heap. Every heap has its own free bins, regions, slab
+ * runs and thread caches, and its own lock in the thread-safe build. Regions
+ * point back to their heap, so any pointer can be freed without naming its heap.
+ * umalloc and ufree work on the default heap set up by uinit.
+ */
+typedef struct uheap_struct
+{
+    memory_block_t *free_bins[FL_INDEX_COUNT][SL_INDEX_COUNT];
+    unsigned int fl_bitmap;                /* bit fl set when level fl has a non-empty bin */
+    unsigned int sl_bitmap[FL_INDEX_COUNT]; /* bit sl set when free_bins[fl][sl] is non-empty */
+    tree_block_t *free_tree;               /* root of the tree of large free blocks */
+    tree_block_t tree_nil;                 /* the leaves of the tree, always black */
+    memory_block_t *quick_lists[QUICK_LIST_COUNT]; /* freed blocks by size / ALIGNMENT */
+    sbrk_block *wilderness_region;         /* the region grown last */
+    memory_block_t *wilderness;            /* its top free block, kept out of the bins */
+    uint64_t fresh;                        /* the wilderness region is untouched from here up */
+    size_t quick_size;                     /* bytes of blocks in the quick lists */
+    sbrk_block *block_head;                /* regions of blocks */
+    sbrk_block *slab_head;                 /* slab runs */
+    sbrk_block *mmap_head;                 /* mappings of large requests */
+    slab_run_t *slab_empty;                /* empty runs that any class may take */
+    thread_cache_t *thread_caches;         /* caches in use or waiting for adoption */
+    thread_cache_t *cache;                 /* the only cache when built without threads */
+    size_t heap_size;                      /* bytes of blocks over all regions */
+    size_t free_size;                      /* bytes of free blocks, wilderness included */
+    size_t recent_size;                    /* moving average of block sizes requested */
+    uint64_t rover;                        /* where the next fit search starts */
+    uheap_stats_t stats;
+    uheap_options_t options;
+    bool initialized;
+    pthread_mutex_t lock;
+    pthread_key_t cache_key;
+} uheap_t;
+
 // Helper Functions, this may be editted if you change the signature in umalloc.c
 bool is_allocated(memory_block_t *block);
-bool is_allocated_footer(footer_t *block);
+bool is_prev_free(memory_block_t *block);
 void allocate(memory_block_t *block);
 void deallocate(memory_block_t *block);
 size_t get_size(memory_block_t *block);
@@ -42,21 +286,59 @@ memory_block_t *get_block(void *payload);
 footer_t *get_footer(memory_block_t *block);
 memory_block_t *get_header(footer_t *footer);
 
-void insert(memory_block_t *block);
-void insert_at_end(memory_block_t *block);
-void remove_from_list(memory_block_t *block);
+void mapping_insert(size_t size, int *fl, int *sl);
+void mapping_search(size_t size, int *fl, int *sl);
+void insert(uheap_t *heap, memory_block_t *block);
+void remove_from_list(uheap_t *heap, memory_block_t *block);
+tree_block_t *tree_first(uheap_t *heap);
+tree_block_t *tree_next(uheap_t *heap, tree_block_t *node);
 memory_block_t *get_above_header(memory_block_t *block);
 footer_t *get_below_footer(memory_block_t *block);
 
-memory_block_t *find(size_t size);
-memory_block_t *extend(size_t size);
-memory_block_t *split(memory_block_t *block, size_t size);
+void pagemap_insert(sbrk_block *region);
+void pagemap_remove(sbrk_block *region);
+void pagemap_extend(sbrk_block *region, uint64_t old_end);
+void pagemap_shrink(sbrk_block *region, uint64_t new_end);
+sbrk_block *pagemap_lookup(void *ptr);
+
+int slab_class(size_t size);
+void *slab_alloc(uheap_t *heap, size_t size);
+void slab_free(slab_run_t *run, void *ptr);
+
+void *mmap_alloc(uheap_t *heap, size_t size, size_t alignment, bool zero);
+void mmap_free(mmap_region_t *map);
+
+memory_block_t *find(uheap_t *heap, size_t size);
+memory_block_t *extend(uheap_t *heap, size_t size);
+memory_block_t *extend_in_place(uheap_t *heap, sbrk_block *region, size_t increment);
+memory_block_t *split(uheap_t *heap, memory_block_t *block, size_t size);
 bool contained_in_block(void *ptr);
-memory_block_t *coalesce(memory_block_t *block);
+memory_block_t *coalesce(uheap_t *heap, memory_block_t *block);
+void consolidate(uheap_t *heap);
 
 size_t get_padded_size(size_t size);
 size_t get_block_size(size_t size);
 
+// Heap handles
+uheap_t *uheap_create(const uheap_options_t *options);
+void *uheap_malloc(uheap_t *heap, size_t size);
+void *uheap_aligned_alloc(uheap_t *heap, size_t alignment, size_t size);
+void *uheap_calloc(uheap_t *heap, size_t count, size_t size);
+void uheap_free(uheap_t *heap, void *ptr);
+void *uheap_realloc(uheap_t *heap, void *ptr, size_t size);
+int uheap_trim(uheap_t *heap, size_t pad);
+void uheap_stats(uheap_t *heap, uheap_stats_t *stats);
+void uheap_destroy(uheap_t *heap);
+uheap_t *uheap_default();
+
+void *ualigned_alloc(size_t alignment, size_t size);
+void *umemalign(size_t alignment, size_t size);
+void *ucalloc(size_t count, size_t size);
+void *urealloc(void *ptr, size_t size);
+size_t umalloc_usable_size(void *ptr);
+int utrim(size_t pad);
+void ustats(uheap_stats_t *stats);
+
 // Portion that may not be edited
 int uinit();
 void *umalloc(size_t size);
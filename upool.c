@@ -0,0 +1,154 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * upool.c - Fixed-size object pools on top of the default umalloc heap. A new
+ * slab is taken with umalloc only when the free list is empty and the newest
+ * slab has been carved to its end. Objects of the newest slab are handed out by
+ * bumping a pointer, so a slab is not touched before its objects are used.
+ **************************************************************************/
+
+#include "umalloc.h"
+#include "upool.h"
+
+/*
+ * upool_create - creates an empty pool of objects of object_size bytes, each
+ * aligned to alignment bytes, which must be a power of two no larger than a page,
+ * or 0 for the umalloc alignment. Returns NULL if an error occurred.
+ */
+upool_t *upool_create(size_t object_size, size_t alignment)
+{
+    if (alignment == 0)
+    {
+        alignment = ALIGNMENT;
+    }
+    if ((alignment & (alignment - 1)) != 0 || alignment > PAGESIZE)
+    {
+        return NULL;
+    }
+    // Every object must be able to hold the free list link
+    if (alignment < sizeof(void *))
+    {
+        alignment = sizeof(void *);
+    }
+    if (object_size < sizeof(void *))
+    {
+        object_size = sizeof(void *);
+    }
+    object_size = (object_size + alignment - 1) & ~(alignment - 1);
+
+    upool_t *pool = umalloc(sizeof(upool_t));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    *pool = (upool_t){0};
+    pool->object_size = object_size;
+    pool->alignment = alignment;
+    pool->slab_objects = (UPOOL_SLAB_SIZE - sizeof(upool_slab_t)) / object_size;
+    if (pool->slab_objects < UPOOL_SLAB_MIN_OBJECTS)
+    {
+        pool->slab_objects = UPOOL_SLAB_MIN_OBJECTS;
+    }
+    return pool;
+}
+
+/*
+ * upool_grow - takes a new slab from the heap and makes it the newest slab. The
+ * slab is large enough to align its first object however umalloc aligned it.
+ * Returns -1 if an error occurred.
+ */
+static int upool_grow(upool_t *pool)
+{
+    size_t pad = pool->alignment > ALIGNMENT ? pool->alignment - ALIGNMENT : 0;
+    upool_slab_t *slab = umalloc(sizeof(upool_slab_t) + pad + pool->slab_objects * pool->object_size);
+    if (slab == NULL)
+    {
+        return -1;
+    }
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    uint64_t start = (uint64_t)(slab + 1);
+    start = (start + pool->alignment - 1) & ~((uint64_t)pool->alignment - 1);
+    pool->next = (char *)start;
+    pool->end = pool->next + pool->slab_objects * pool->object_size;
+    return 0;
+}
+
+/*
+ * upool_alloc - returns an object of the pool, the most recently freed one if any.
+ * Returns NULL if an error occurred.
+ */
+void *upool_alloc(upool_t *pool)
+{
+    void *object = pool->free_list;
+    if (object != NULL)
+    {
+        pool->free_list = *(void **)object;
+        pool->free_count--;
+        return object;
+    }
+    if (pool->next == pool->end && upool_grow(pool) == -1)
+    {
+        return NULL;
+    }
+    object = pool->next;
+    pool->next += pool->object_size;
+    return object;
+}
+
+/*
+ * upool_free - gives an object back to the pool it came from. ptr may be NULL.
+ */
+void upool_free(upool_t *pool, void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    *(void **)ptr = pool->free_list;
+    pool->free_list = ptr;
+    pool->free_count++;
+}
+
+/*
+ * upool_reserve - makes sure that count more objects can be allocated from the
+ * pool without taking another slab from the heap. Returns -1 if an error occurred.
+ */
+int upool_reserve(upool_t *pool, size_t count)
+{
+    size_t available = pool->free_count + (pool->end - pool->next) / pool->object_size;
+    while (available < count)
+    {
+        // Thread the rest of the newest slab onto the free list before replacing it
+        while (pool->next != pool->end)
+        {
+            upool_free(pool, pool->next);
+            pool->next += pool->object_size;
+        }
+        if (upool_grow(pool) == -1)
+        {
+            return -1;
+        }
+        available += pool->slab_objects;
+    }
+    return 0;
+}
+
+/*
+ * upool_destroy - frees every object of the pool, its slabs and the pool itself.
+ */
+void upool_destroy(upool_t *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+    upool_slab_t *slab = pool->slabs;
+    while (slab != NULL)
+    {
+        upool_slab_t *next = slab->next;
+        ufree(slab);
+        slab = next;
+    }
+    ufree(pool);
+}
@@ -0,0 +1,49 @@
+/**************************************************************************
+ * C S 429 MM-lab
+ *
+ * upool.h - Pools of fixed-size objects. Objects are carved out of slabs taken
+ * from the default umalloc heap and have no header of their own; freed objects
+ * are kept in an intrusive free list, so both upool_alloc and upool_free are
+ * constant time.
+ **************************************************************************/
+
+#ifndef UPOOL_H
+#define UPOOL_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "csbrk.h"
+
+#define UPOOL_SLAB_SIZE (4 * PAGESIZE) /* default bytes per slab */
+#define UPOOL_SLAB_MIN_OBJECTS 8       /* objects per slab at the least */
+
+/*
+ * upool_slab_t - The header in front of every slab of a pool.
+ */
+typedef struct upool_slab
+{
+    struct upool_slab *next;
+} upool_slab_t;
+
+/*
+ * upool_t - A pool. Not thread safe: each thread should use pools of its own.
+ */
+typedef struct upool
+{
+    size_t object_size;  /* bytes per object, a multiple of alignment */
+    size_t alignment;    /* alignment of every object, a power of two */
+    size_t slab_objects; /* objects per slab */
+    upool_slab_t *slabs;
+    void *free_list;     /* freed objects, each holding the next one */
+    char *next;          /* next object never handed out in the newest slab */
+    char *end;           /* end of the newest slab */
+    size_t free_count;   /* objects in the free list */
+} upool_t;
+
+upool_t *upool_create(size_t object_size, size_t alignment);
+void *upool_alloc(upool_t *pool);
+void upool_free(upool_t *pool, void *ptr);
+int upool_reserve(upool_t *pool, size_t count);
+void upool_destroy(upool_t *pool);
+
+#endif